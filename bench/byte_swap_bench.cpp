@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "basic_tools.h"
+#include "byte_swap.h"
+#include "timer.h"
+
+// byte_swap_bench [KiB] [rounds]: in place swap of 16/32/64-bit arrays, one byte_swap() per element against
+// byte_swap_array() with the kernel picked at runtime
+template <typename T>
+static void bench(const char *name, size_t bytes, int rounds)
+{
+    size_t         count = bytes / sizeof(T);
+    std::vector<T> data(count);
+    for (size_t i = 0; i < count; i++)
+        data[i] = (T)(i * 0x9E3779B97F4A7C15ull);
+
+    // best round of each, the two run in turns so neither gets a warmer cache or clock
+    uint64_t scalar_us = UINT64_MAX;
+    uint64_t array_us  = UINT64_MAX;
+    for (int r = 0; r < rounds; r++)
+    {
+        uint64_t start = gettime_us();
+        for (size_t i = 0; i < count; i++)
+            data[i] = byte_swap(data[i]);
+        uint64_t mid = gettime_us();
+        byte_swap_array(data.data(), data.data(), count);
+        uint64_t end = gettime_us();
+
+        scalar_us = MIN(scalar_us, mid - start);
+        array_us  = MIN(array_us, end - mid);
+    }
+
+    // two swaps a round, so data is back to the start value
+    uint64_t check = 0;
+    for (size_t i = 0; i < count; i++)
+        check ^= (uint64_t)data[i];
+
+    double mb = (double)count * sizeof(T) / (1024.0 * 1024.0);
+    printf("%-6s scalar %8.1f MiB/s  %-6s %8.1f MiB/s  x%.2f  (%016llx)\n", name, mb * 1e6 / (scalar_us + 1),
+           byte_swap_impl(), mb * 1e6 / (array_us + 1), (double)(scalar_us + 1) / (array_us + 1),
+           (unsigned long long)check);
+}
+
+int main(int argc, char **argv)
+{
+    size_t kib    = argc > 1 ? strtoul(argv[1], nullptr, 10) : 65536;
+    int    rounds = argc > 2 ? atoi(argv[2]) : 10;
+    if (kib == 0 || rounds <= 0)
+    {
+        fprintf(stderr, "usage: %s [KiB] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    bench<uint16_t>("u16", kib << 10, rounds);
+    bench<uint32_t>("u32", kib << 10, rounds);
+    bench<uint64_t>("u64", kib << 10, rounds);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "logger.h"
+#include "timer.h"
+
+// log_format_bench [calls]: one log line formatted with snprintf, the runtime Log::format_to, the LOG_FMT checked
+// Log::format_to and Log::format, with the time and the heap allocations per call
+
+static std::atomic<uint64_t> alloc_count{0};
+
+void *operator new(size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+template <typename F>
+static void bench(const char *name, int calls, F func)
+{
+    size_t   total  = 0;
+    uint64_t allocs = alloc_count.load();
+    uint64_t start  = gettime_us();
+    for (int i = 0; i < calls; i++)
+        total += func(i);
+    uint64_t used_us = gettime_us() - start;
+    allocs           = alloc_count.load() - allocs;
+
+    printf("%-18s %8.1f ns/call  %5.2f allocs/call  (%zu bytes)\n", name, used_us * 1000.0 / calls,
+           (double)allocs / calls, total);
+}
+
+int main(int argc, char **argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (calls <= 0)
+    {
+        fprintf(stderr, "usage: %s [calls]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string name = "reader";
+    char              buf[256];
+
+    bench("snprintf", calls, [&](int i) {
+        return (size_t)snprintf(buf, sizeof(buf), "%s pos=%#x size=%d ratio=%.3f\n", name.c_str(), i, i * 3,
+                                i / 7.0);
+    });
+    bench("format_to", calls, [&](int i) {
+        return Log::format_to(buf, sizeof(buf), "{} pos={#x} size={} ratio={.3f}\n", name, i, i * 3, i / 7.0);
+    });
+    bench("format_to LOG_FMT", calls, [&](int i) {
+        return Log::format_to(buf, sizeof(buf), LOG_FMT("{} pos={#x} size={} ratio={.3f}\n"), name, i, i * 3,
+                              i / 7.0);
+    });
+    bench("format {} only", calls, [&](int i) {
+        return Log::format("{} pos={} size={} ratio={}\n", name, i, i * 3, i / 7.0).size();
+    });
+    bench("format", calls, [&](int i) {
+        return Log::format("{} pos={#x} size={} ratio={.3f}\n", name, i, i * 3, i / 7.0).size();
+    });
+    return 0;
+}
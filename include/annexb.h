@@ -0,0 +1,87 @@
+#ifndef Z_ANNEXB_H
+#define Z_ANNEXB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binary_file.h"
+
+// offset of the first 00 00 <third> in data, size if there is none.
+// 16/32 bytes at a time with sse2/avx2/neon when the cpu has them
+size_t find_00_00_xx(const uint8_t *data, size_t size, uint8_t third);
+
+// 00 00 03, the 03 is an emulation prevention byte inside a NAL unit
+static inline size_t find_emulation_prevention(const uint8_t *data, size_t size)
+{
+    return find_00_00_xx(data, size, 0x03);
+}
+
+// 00 00 01, start code prefix of a NAL unit
+static inline size_t find_start_code(const uint8_t *data, size_t size)
+{
+    return find_00_00_xx(data, size, 0x01);
+}
+
+struct NalUnitInfo
+{
+    uint64_t offset   = 0; // file offset of the NAL unit header, right after the start code
+    uint64_t length   = 0; // up to the next start code, without the zero bytes in front of it
+    uint8_t  nal_type = 0;
+};
+
+// splits an Annex-B elementary stream into NAL units, searching the reader's window in place.
+// moves the cursor of reader
+struct AnnexBScanner
+{
+    AnnexBScanner(BinaryReader &reader, bool hevc = false, uint64_t start = 0)
+        : reader(reader), hevc(hevc), next_nal(start)
+    {
+    }
+
+    // false at the end of file
+    bool next(NalUnitInfo &nal);
+
+    struct iterator
+    {
+        AnnexBScanner *scanner = nullptr;
+        NalUnitInfo    nal;
+
+        const NalUnitInfo &operator*() const { return nal; }
+        const NalUnitInfo *operator->() const { return &nal; }
+
+        iterator &operator++()
+        {
+            if (!scanner->next(nal))
+                scanner = nullptr;
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const { return scanner == other.scanner; }
+        bool operator!=(const iterator &other) const { return scanner != other.scanner; }
+    };
+
+    iterator begin()
+    {
+        iterator it;
+        it.scanner = this;
+        return ++it;
+    }
+    iterator end() { return iterator(); }
+
+    // offset of the next 00 00 01 from pos, the file size if none.
+    // zeros gets the zero bytes in front of it, not looking before limit
+    uint64_t find_next(uint64_t pos, uint64_t limit, uint64_t &zeros);
+
+private:
+    BinaryReader &reader;
+    bool          hevc;
+    bool          started  = false;
+    uint64_t      next_nal = 0;
+
+    uint64_t count_zeros_before(uint64_t pos, uint64_t limit);
+};
+
+// first start code at or after pos, the file size if none. resync hook for parallel_scan
+uint64_t resync_start_code(BinaryReader &reader, uint64_t pos);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef Z_ARENA_H
+#define Z_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory_resource>
+#include <vector>
+
+// bump allocator for short lived parse objects that all die together, e.g. the strings of one file.
+// deallocate does nothing, reset() releases everything at once and keeps the blocks for the next round.
+// not thread safe
+struct Arena : public std::pmr::memory_resource
+{
+    static const size_t default_block_size = 64 * 1024;
+
+    explicit Arena(size_t block_size = default_block_size,
+                   std::pmr::memory_resource *upstream = std::pmr::new_delete_resource());
+    ~Arena();
+
+    Arena(const Arena &)            = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *alloc(size_t size, size_t align = alignof(max_align_t));
+
+    // everything allocated so far is gone, blocks bigger than block_size go back to upstream
+    void reset();
+
+    size_t used() const { return used_size; }
+    size_t capacity() const;
+    size_t alloc_count() const { return count; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override { return alloc(bytes, alignment); }
+    void  do_deallocate(void *, size_t, size_t) override {}
+    bool  do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+    struct Block
+    {
+        uint8_t *mem;
+        size_t   size;
+        size_t   align;
+    };
+
+    size_t                     block_size;
+    std::pmr::memory_resource *upstream;
+
+    std::vector<Block> blocks;    // block_size each, reused after reset()
+    std::vector<Block> oversized; // single allocations bigger than block_size
+    size_t             cur_block = 0;
+    size_t             cur_pos   = 0;
+    size_t             used_size = 0;
+    size_t             count     = 0;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef Z_ASYNC_READER_H
+#define Z_ASYNC_READER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "binary_file.h"
+
+struct ReadRequest
+{
+    uint64_t  offset = 0;
+    uint64_t  length = 0;
+    DataBlock dest;       // created from BlockPool with length bytes if it is smaller
+    int64_t   result = 0; // bytes read, short at the end of file, -errno on failure
+};
+
+using ReadBatch         = std::vector<ReadRequest>;
+using ReadBatchCallback = std::function<void(ReadBatch &batch)>;
+
+struct ReadEngine;
+
+// batched positional reads of one file: io_uring on linux when the kernel allows it, else a pool of
+// threads doing pread. all requests of a batch are submitted together and the batch completes as a whole
+struct AsyncReader
+{
+    AsyncReader() {}
+    ~AsyncReader() { close(); }
+
+    // queue_depth: requests in flight with io_uring, threads: workers of the pread fallback
+    int  open(std::string &fn, int queue_depth = 64, int threads = 4, bool use_io_uring = true);
+    void close(); // waits for the submitted batches
+
+    bool is_io_uring() const;
+
+    // callback runs on an engine thread when every request of batch is done, it must not block on
+    // other batches of this reader
+    int                    submit(ReadBatch batch, ReadBatchCallback callback);
+    std::future<ReadBatch> submit(ReadBatch batch);
+
+private:
+    int         fd     = -1;
+    ReadEngine *engine = nullptr;
+};
+
+#endif
@@ -4,8 +4,18 @@
 
 #include <string.h>
 
-#include <string>
+#include <atomic>
+#include <list>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "block_pool.h"
+#include "byte_swap.h"
 
 #ifndef MAX
     #define MAX(a, b) (((a) > (b)) ? (a) : (b))
@@ -15,12 +25,21 @@
     #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
-void     splitpath(std::string &path, std::string &drv, std::string &dir, std::string &name, std::string &ext);
+void splitpath(std::string &path, std::string &drv, std::string &dir, std::string &name, std::string &ext);
+// same, the parts are allocated from the resource of each string, e.g. an Arena
+void splitpath(const std::string &path, std::pmr::string &drv, std::pmr::string &dir, std::pmr::string &name,
+               std::pmr::string &ext);
 uint64_t get_file_size(FILE *fp);
 
+// copies share the storage, the last one frees it
 struct DataBlock
 {
+    static const uint64_t default_align   = 64;
+    static const uint64_t default_padding = 64; // AV_INPUT_BUFFER_PADDING_SIZE
+    static const uint64_t huge_threshold  = 32 * 1024 * 1024;
+
     uint64_t                   length;
+    uint64_t                   offset = 0; // of ptr() inside data, non 0 for slices
     std::shared_ptr<uint8_t[]> data;
 
     DataBlock() : length(0) {}
@@ -28,15 +47,139 @@ struct DataBlock
 
     ~DataBlock() {}
 
-    DataBlock &operator=(const DataBlock &) = delete;
-
     void create(uint64_t len)
     {
         data   = std::shared_ptr<uint8_t[]>(new uint8_t[len]);
         length = len;
+        offset = 0;
     }
 
-    uint8_t *ptr() const { return this->data.get(); }
+    // buffer and reference count from BlockPool, both go back to the pool when the last reference drops
+    void create_pooled(uint64_t len)
+    {
+        data   = std::shared_ptr<uint8_t[]>((uint8_t *)BlockPool::alloc(len), PoolDeleter{len},
+                                            PoolAllocator<uint8_t>());
+        length = len;
+        offset = 0;
+    }
+
+    // ptr() aligned to align (a power of 2) and followed by padding zero bytes not counted in length,
+    // e.g. for simd loads, O_DIRECT buffers or FFmpeg packet data. from huge_threshold up the block
+    // is mapped on huge pages where the system has them
+    void create_aligned(uint64_t len, uint64_t align = default_align, uint64_t padding = default_padding);
+
+    // len bytes from off sharing the storage without copying, shorter at the end of this block
+    DataBlock slice(uint64_t off, uint64_t len) const
+    {
+        DataBlock part;
+
+        off         = MIN(off, length);
+        part.data   = data;
+        part.offset = offset + off;
+        part.length = MIN(len, length - off);
+        return part;
+    }
+
+    uint8_t *ptr() const { return this->data.get() + offset; }
+};
+
+// blocks (or slices) kept apart but handled as one, BinaryWriter::write_chain writes them with one
+// gather call
+struct DataChain
+{
+    std::vector<DataBlock> segments;
+    uint64_t               length = 0;
+
+    void append(const DataBlock &block)
+    {
+        if (block.length == 0)
+            return;
+        segments.push_back(block);
+        length += block.length;
+    }
+
+    void clear()
+    {
+        segments.clear();
+        length = 0;
+    }
+
+    bool empty() const { return 0 == length; }
+
+    // copy of all segments in one block
+    DataBlock flatten() const
+    {
+        DataBlock block(length);
+        uint64_t  pos = 0;
+        for (auto &seg : segments)
+        {
+            memcpy(block.ptr() + pos, seg.ptr(), seg.length);
+            pos += seg.length;
+        }
+        return block;
+    }
+};
+
+// non-owning bytes inside a reader window, valid until the next refill of that reader
+// (until close() when the reader is mapped)
+struct ByteView
+{
+    const uint8_t *data = nullptr;
+    uint64_t       size = 0;
+
+    bool           empty() const { return 0 == size; }
+    const uint8_t *begin() const { return data; }
+    const uint8_t *end() const { return data + size; }
+    uint8_t        operator[](uint64_t idx) const { return data[idx]; }
+};
+
+struct ReadAhead;
+
+// fixed size pages of one file kept in memory with LRU eviction, shared by any number of readers of
+// that file (see BinaryReader::set_block_cache), from any thread. a page handed out stays valid while
+// its shared_ptr is held, even after eviction
+struct BlockCache
+{
+    static const uint64_t default_page_size = 64 * 1024;
+    static const uint64_t page_align        = 4096;
+
+    explicit BlockCache(uint64_t capacity, uint64_t page_size = default_page_size);
+
+    // page page_idx, read from fp on a miss. page_len gets its size (short at the end of file), loaded
+    // (if given) whether this call read it from fp
+    std::shared_ptr<const uint8_t> get(FILE *fp, uint64_t file_size, uint64_t page_idx, uint64_t &page_len,
+                                       bool *loaded = nullptr);
+
+    // the cache keeps the pages of the first file bound, false for any other
+    bool bind(const std::string &file);
+    void clear();
+
+    uint64_t get_page_size() const { return page_size; }
+    uint64_t get_capacity() const { return max_pages * page_size; }
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+    uint64_t evictions() const { return evict_count; }
+    double   hit_ratio() const;
+
+private:
+    struct Page
+    {
+        uint64_t                       idx;
+        uint64_t                       len;
+        std::shared_ptr<const uint8_t> data;
+    };
+
+    uint64_t    page_size;
+    uint64_t    max_pages;
+    std::string file_name;
+
+    std::list<Page>                                         lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<Page>::iterator> pages;
+    std::mutex                                              mutex;
+
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+    std::atomic<uint64_t> evict_count{0};
 };
 
 struct BinaryReader
@@ -50,44 +193,157 @@ struct BinaryReader
     FILE *fp = NULL;
 
     bool opened = false;
+    bool mapped = false; // whole file mapped into memory, reads go straight to the mapping
 
     uint64_t fileSize = 0;
     uint64_t _read_pos = 0;
 
+    uint64_t io_stall_us     = 0; // time spent blocked in window refills
+    uint64_t read_ahead_hits = 0; // refills served by an already prefetched window
+    uint64_t cache_hits      = 0; // refills served by a page already in the block cache
+    uint64_t buffer_hits     = 0; // reads served by the current window
+    uint64_t buffer_misses   = 0; // window refills
+    uint64_t bytes_read      = 0; // bytes read from the file by refills (read ahead, cache misses) and direct reads
+
+    enum REFILL_POLICY_E
+    {
+        REFILL_FORWARD,  // window starts at the requested offset
+        REFILL_CENTER,   // requested bytes in the middle of the window, for reads around a position
+        REFILL_BACKWARD, // window ends right after the requested bytes, for backward scans
+    };
+
+    static const uint64_t default_buffer_size = 1024 * 1024;
+    static const uint64_t min_buffer_size     = 4096; // smaller windows are raised to it, a read_u64 must fit
+
 private:
-    static const uint64_t buffer_size = 1024 * 1024;
-    uint8_t              *read_buffer;
-    uint64_t              buffer_start_pos;
-    uint64_t              buffer_contain_size;
+    uint64_t        buffer_size         = default_buffer_size;
+    uint64_t        read_buffer_size    = 0;       // allocated size of read_buffer, may exceed buffer_size
+    uint8_t        *read_buffer         = nullptr; // heap window of stdio mode, allocated on first use
+    uint8_t        *buffer_ptr          = nullptr; // current window, read_buffer or the mapping
+    uint64_t        buffer_start_pos    = 0;
+    uint64_t        buffer_contain_size = 0;
+    REFILL_POLICY_E refill_policy       = REFILL_FORWARD;
+    uint64_t        adaptive_min_size   = 0; // 0: fixed buffer_size
+    uint64_t        adaptive_max_size   = 0;
+
+    uint8_t *map_addr = nullptr;
+#if defined(WIN32) || defined(_WIN32)
+    void *map_handle = nullptr;
+#endif
+
+    ReadAhead *read_ahead = nullptr;
+
+    std::shared_ptr<BlockCache>    block_cache;
+    std::shared_ptr<const uint8_t> cache_page; // holds the page the window points into
+
+    bool attached = false; // fp and mapping borrowed from another reader, not closed here
+
+    Arena *arena = nullptr;
 
 private:
-    int check_buffer(uint64_t read_psos, uint64_t read_size);
+    int  check_buffer(uint64_t read_psos, uint64_t read_size);
+    bool load_cache_page(uint64_t read_pos, uint64_t read_size);
+    bool continues_window(uint64_t read_pos) const;
+    void adapt_buffer_size(uint64_t read_pos);
+    void alloc_read_buffer(uint64_t size);
+    int  map_file();
+    void unmap_file();
+
+    const uint8_t *fetch_slow(uint64_t len, uint8_t *tmp);
+
+    template <typename Str>
+    void read_str_to(Str &dst_string, uint64_t max_len);
+
+    // len bytes at the cursor, straight from the window when it holds them, else copied to tmp
+    // (zero filled past the end of file). the cursor moves past them
+    const uint8_t *fetch(uint64_t len, uint8_t *tmp)
+    {
+        if (_read_pos >= buffer_start_pos && _read_pos + len <= buffer_start_pos + buffer_contain_size)
+        {
+            const uint8_t *src = buffer_ptr + (_read_pos - buffer_start_pos);
+            _read_pos += len;
+            buffer_hits++;
+            return src;
+        }
+        return fetch_slow(len, tmp);
+    }
 
 public:
-    BinaryReader() { read_buffer = new uint8_t[buffer_size]; }
+    BinaryReader() {}
 
-    explicit BinaryReader(std::string &fn) : BinaryReader() { open(fn); }
+    explicit BinaryReader(std::string &fn, bool use_mmap = false) : BinaryReader() { open(fn, use_mmap); }
 
     ~BinaryReader()
     {
         if (opened)
             close();
+        disable_read_ahead();
         delete[] read_buffer;
     }
 
-    int open(std::string &fn);
+    // use_mmap: map the whole file instead of reading through the 1M window,
+    // falls back to stdio reading if the mapping can't be created
+    int open(std::string &fn, bool use_mmap = false);
+
+    // second reader over the file of owner, sharing its file handle (positional reads only) or
+    // mapping but with its own cursor and window, e.g. one per worker thread. owner must stay
+    // open while this one is in use
+    int attach(const BinaryReader &owner);
 
     int close();
 
+    // prefetch the next depth windows of window_size bytes (0: the buffer size) in a background thread
+    // while the current one is parsed, for sequential scans. mapped readers only pass a sequential hint
+    // to the kernel. stays on until disable_read_ahead() or close()
+    int  enable_read_ahead(uint64_t window_size = 0, int depth = 2);
+    void disable_read_ahead();
+
+    // window size of the next refills in stdio mode (at least min_buffer_size), also the most peek_view()
+    // can return
+    void     set_buffer_size(uint64_t size);
+    uint64_t get_buffer_size() const { return buffer_size; }
+
+    // where a refill puts the window around the requested bytes
+    void set_refill_policy(REFILL_POLICY_E policy) { refill_policy = policy; }
+
+    // double the buffer size (up to max_size) on refills continuing the current window, halve it
+    // (down to min_size, at least min_buffer_size) on refills after a jump. min_size 0 goes back to the fixed size
+    void set_adaptive_buffer(uint64_t min_size, uint64_t max_size);
+
+    // serve refills after a jump that fit in one page from cache, so hot regions far apart (e.g. moov and
+    // mdat) stay resident. refills continuing the window still use the buffer size and read ahead.
+    // nullptr turns it off. fails if cache already holds another file
+    int set_block_cache(std::shared_ptr<BlockCache> cache);
+
     uint64_t set_file_cursor(uint64_t abs_offset);
     uint64_t read(void *buf, uint64_t len);
 
     uint64_t jump_read(uint64_t pos, void *buf, uint64_t len); // read len from pos, then back to the _read_pos before
 
+    // len bytes at offset straight from the file or mapping, the cursor and window are not touched,
+    // safe to call from several threads at once. returns the bytes read
+    uint64_t read_at(uint64_t offset, void *buf, uint64_t len) const;
+
     uint64_t read_still(void *buf, uint64_t len);
 
+    // view of up to len bytes at the cursor without copying, shorter at the end of file or when
+    // len exceeds the window; read_view also moves the cursor past the returned bytes
+    ByteView peek_view(uint64_t len);
+    ByteView read_view(uint64_t len);
+    // everything from the cursor to the end of the window holding it (at least min_len bytes
+    // unless the file ends), for scanners that don't care where the window starts
+    ByteView peek_window(uint64_t min_len = 1);
+
     std::string read_str(uint64_t max_len);
 
+    // per file allocations (read_pstr) come from arena. the reader never resets it, the owner does, e.g.
+    // between files, and keeps it alive while read_pstr is used. one arena for one reader, it isn't thread safe.
+    // nullptr goes back to the default resource
+    void set_arena(Arena *new_arena) { arena = new_arena; }
+
+    // read_str allocated from the arena, valid until the arena is reset
+    std::pmr::string read_pstr(uint64_t max_len);
+
     uint64_t read_data(void *buf, uint16_t buf_len, uint16_t data_len, bool reverse);
 
     uint8_t  read_u8();
@@ -102,6 +358,112 @@ public:
     uint64_t read_un(uint16_t bytes, bool reverse);
     int64_t  read_sn(uint16_t bytes, bool reverse);
     uint64_t set_cursor(uint64_t pos);
+
+    // typed reads with the file byte order fixed at compile time
+    template <typename T, ENDIAN_E endian>
+    T read()
+    {
+        uint8_t tmp[sizeof(T)];
+        T       res;
+        memcpy(&res, fetch(sizeof(T), tmp), sizeof(T));
+        return to_host<endian>(res);
+    }
+
+    // N (1~8) bytes integer, e.g. 3 bytes sizes or 6 bytes timestamps
+    template <int N, ENDIAN_E endian>
+    uint64_t read_uN()
+    {
+        uint8_t tmp[N];
+        return load_un<N, endian>(fetch(N, tmp));
+    }
+
+    template <int N, ENDIAN_E endian>
+    int64_t read_sN()
+    {
+        uint8_t tmp[N];
+        return load_sn<N, endian>(fetch(N, tmp));
+    }
+
+    // count integers in one read, for sample tables. returns the number of whole items read
+    template <typename T, ENDIAN_E endian>
+    uint64_t read_array(T *out, uint64_t count)
+    {
+        uint64_t rd_cnt = read(out, count * sizeof(T)) / sizeof(T);
+        to_host_array<endian>(out, rd_cnt);
+        return rd_cnt;
+    }
+};
+
+// buffered sequential writer, the counterpart of BinaryReader.
+// small fields are gathered in a 1M buffer and written out with one positional write per flush
+struct BinaryWriter
+{
+    std::string fn;
+
+    FILE *fp = NULL;
+
+    bool opened = false;
+    bool direct = false; // O_DIRECT, the buffer is written in 4K aligned blocks
+
+    uint64_t _write_pos  = 0;
+    uint64_t flush_count = 0; // write syscalls issued
+
+private:
+    static const uint64_t buffer_size      = 1024 * 1024;
+    static const uint64_t direct_align     = 4096;
+    uint8_t              *buffer_mem       = nullptr;
+    uint8_t              *write_buffer     = nullptr; // buffer_mem aligned to direct_align
+    uint64_t              buffer_start_pos = 0;       // file offset of write_buffer[0]
+    uint64_t              buffer_fill_size = 0;
+
+private:
+    int flush_buffer(bool final);
+    int patch_file(uint64_t pos, const void *buf, uint64_t len);
+
+public:
+    BinaryWriter() {}
+
+    explicit BinaryWriter(std::string &fn, bool direct_io = false) : BinaryWriter() { open(fn, direct_io); }
+
+    ~BinaryWriter()
+    {
+        if (opened)
+            close();
+        delete[] buffer_mem;
+    }
+
+    // create or truncate fn. direct_io: bypass the page cache with O_DIRECT where supported,
+    // falls back to normal writes if the file system refuses it
+    int open(std::string &fn, bool direct_io = false);
+
+    int close();
+
+    // write out the buffer. in direct mode the unaligned tail stays buffered until close()
+    int flush();
+
+    uint64_t write(const void *buf, uint64_t len);
+
+    // all segments in order, big chains go to the file with pwritev instead of through the buffer
+    uint64_t write_chain(const DataChain &chain);
+
+    uint64_t write_u8(uint8_t val);
+    uint64_t write_s8(int8_t val);
+    uint64_t write_u16(uint16_t val, bool reverse);
+    uint64_t write_s16(int16_t val, bool reverse);
+    uint64_t write_u32(uint32_t val, bool reverse);
+    uint64_t write_s32(int32_t val, bool reverse);
+    uint64_t write_u64(uint64_t val, bool reverse);
+    uint64_t write_s64(int64_t val, bool reverse);
+
+    uint64_t write_un(uint64_t val, uint16_t bytes, bool reverse);
+
+    // leave len zero bytes to be filled later with patch(), e.g. a box size. returns their position
+    uint64_t reserve(uint64_t len);
+
+    // overwrite bytes written before, whether still buffered or already in the file
+    uint64_t patch(uint64_t pos, const void *buf, uint64_t len);
+    uint64_t patch_u32(uint64_t pos, uint32_t val, bool reverse);
+    uint64_t patch_u64(uint64_t pos, uint64_t val, bool reverse);
 };
 
 #endif
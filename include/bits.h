@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 #ifdef __linux
     #include <byteswap.h>
 #else
@@ -13,23 +15,111 @@
     #define bswap_64(n) ((uint64_t)bswap_32((uint32_t)(n)) << 32 | bswap_32((uint32_t)((n) >> 32)))
 
 #endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+// val must not be 0
+static inline int count_leading_zeros64(uint64_t val)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx, val);
+    return 63 - (int)idx;
+#else
+    return __builtin_clzll(val);
+#endif
+}
+
 struct BitsReader
 {
     uint8_t *buf;
     uint32_t size_bits = 0;
     uint32_t ptr       = 0;
     BitsReader()       = delete;
-    BitsReader(void *buf, uint32_t size_bytes)
+    // rbsp: buf is a NAL unit payload, its emulation prevention bytes (00 00 03) are skipped on
+    // the fly and size_bits / ptr count the bits without them
+    BitsReader(void *buf, uint32_t size_bytes, bool rbsp = false)
     {
         this->buf = (uint8_t *)buf;
         size_bits = size_bytes * 8;
         ptr       = 0;
+        if (rbsp)
+            find_epb(size_bytes);
     }
     ~BitsReader() {}
 
-    uint8_t  read_bit();
-    uint32_t read_bit(int bits_cnt);
+    uint8_t read_bit() { return (uint8_t)read_bit(1); }
+
+    // bits past size_bits read as zeros and ptr stops at size_bits
+    uint32_t read_bit(int bits_cnt)
+    {
+        if (bits_cnt > 32)
+        {
+            skip_bits(bits_cnt - 32);
+            bits_cnt = 32;
+        }
+        uint32_t res = peek_bits(bits_cnt);
+        skip_bits(bits_cnt);
+        return res;
+    }
+
+    // next bits_cnt (<= 32) bits without moving ptr
+    uint32_t peek_bits(int bits_cnt)
+    {
+        if (bits_cnt <= 0)
+            return 0;
+        if (cache_ptr != ptr || cache_bits < (uint32_t)bits_cnt)
+            refill();
+        return (uint32_t)(cache >> (64 - bits_cnt));
+    }
+
+    void skip_bits(uint32_t bits_cnt)
+    {
+        uint32_t left = ptr < size_bits ? size_bits - ptr : 0;
+        if (bits_cnt > left)
+            bits_cnt = left;
+
+        if (cache_ptr == ptr && bits_cnt < cache_bits)
+        {
+            cache <<= bits_cnt;
+            cache_bits -= bits_cnt;
+            cache_ptr += bits_cnt;
+        }
+        ptr += bits_cnt;
+    }
+
     uint32_t read_golomb();
+
+    // exp-golomb syntax elements. the 32 bits versions saturate when the code doesn't fit,
+    // the 64 bits ones take codes of up to 63 leading zeros. longer codes give UINT64_MAX / INT64_MIN,
+    // values no valid code decodes to
+    uint32_t read_ue();
+    int32_t  read_se();
+    uint32_t read_te(uint32_t range);
+    uint64_t read_ue64();
+    int64_t  read_se64();
+
+    // count codes in a row, e.g. scaling lists or reference list modifications
+    void read_ue_n(uint32_t *out, uint32_t count);
+    void read_se_n(int32_t *out, uint32_t count);
+
+private:
+    // bits from cache_ptr on, msb first, zeros past size_bits.
+    // checked against ptr on use, so moving ptr by hand stays valid
+    uint64_t cache      = 0;
+    uint32_t cache_ptr  = 0;
+    uint32_t cache_bits = 0;
+
+    std::vector<uint32_t> epb_pos;  // raw offsets of the emulation prevention bytes in rbsp mode
+    uint32_t              raw_size = 0;
+
+    void     refill();
+    void     find_epb(uint32_t size_bytes);
+    uint64_t load_rbsp(uint32_t byte_ptr);
+    uint32_t read_zeros();
+    int      read_short_ue();
 };
 
 struct BitsWriter
@@ -38,16 +128,62 @@ struct BitsWriter
     uint32_t size_bits = 0;
     uint32_t ptr       = 0;
     BitsWriter()       = delete;
-    BitsWriter(void *buf, uint32_t size_bytes)
+    // rbsp: the bits written are rbsp and buf gets the NAL unit payload, emulation prevention
+    // bytes inserted. bytes are written once complete, so the writing is sequential only
+    BitsWriter(void *buf, uint32_t size_bytes, bool rbsp = false)
     {
-        this->buf = (uint8_t *)buf;
-        size_bits = size_bytes * 8;
-        ptr       = 0;
+        this->buf  = (uint8_t *)buf;
+        size_bits  = size_bytes * 8;
+        ptr        = 0;
+        this->rbsp = rbsp;
+    }
+    // write into storage, growing it as needed instead of stopping at a fixed size
+    explicit BitsWriter(std::vector<uint8_t> &storage, bool rbsp = false)
+    {
+        this->storage = &storage;
+        buf           = storage.data();
+        size_bits     = (uint32_t)storage.size() * 8;
+        ptr           = 0;
+        this->rbsp    = rbsp;
     }
     ~BitsWriter() {}
 
+    // bits past size_bits are dropped and overflowed() turns true, the other bits of the touched bytes
+    // are kept. in rbsp mode nothing more is written once a byte didn't fit
     void write_bit(uint8_t val);
     void write_bit(int bits_cnt, uint64_t val);
+
+    void write_ue(uint64_t val);
+    void write_se(int64_t val);
+
+    // pad with fill bits up to the next byte boundary
+    void byte_align(uint8_t fill = 0);
+
+    // rbsp mode, after the last bits: pad with zero bits to a whole byte and end a payload whose last
+    // byte is 0x00 (e.g. cabac_zero_words) with 0x03
+    void finish_rbsp();
+
+    // the buffer was too small for some of the bits or bytes
+    bool overflowed() const { return overflow; }
+
+    // in rbsp mode bits_written counts rbsp bits and bytes_written the payload bytes in buf
+    uint32_t bits_written() const { return ptr; }
+    uint32_t bytes_written() const { return rbsp ? out_size : (ptr + 7) / 8; }
+
+private:
+    std::vector<uint8_t> *storage = nullptr;
+
+    bool     rbsp          = false;
+    bool     overflow      = false;
+    uint64_t rbsp_acc      = 0; // rbsp bits not yet making a whole byte
+    uint32_t rbsp_acc_bits = 0;
+    uint32_t out_size      = 0;
+    int      zero_run      = 0; // 0x00 bytes just written, 2 of them need a 0x03 before 0x00~0x03
+
+    bool grow(uint32_t need_bits);
+    void put_bits(int bits_cnt, uint32_t val);
+    void put_bits_rbsp(int bits_cnt, uint32_t val);
+    void emit_byte(uint8_t val);
 };
 
 #endif
\ No newline at end of file
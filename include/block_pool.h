@@ -0,0 +1,64 @@
+#ifndef Z_BLOCK_POOL_H
+#define Z_BLOCK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// process wide recycling allocator for payload buffers, power of 2 size classes from 64 bytes to 16M.
+// freed blocks go to a small per thread cache first, then to a shared list per class, larger sizes
+// always come from new
+namespace BlockPool
+{
+    struct Stats
+    {
+        uint64_t hits;       // served from a thread cache or shared list
+        uint64_t misses;     // allocated with new
+        uint64_t releases;   // blocks given back
+        uint64_t cached;     // bytes kept in the shared lists
+        uint64_t thread_hit; // part of hits served without taking a lock
+    };
+
+    void *alloc(uint64_t size);
+    void  release(void *ptr, uint64_t size);
+
+    Stats get_stats();
+
+    // free the blocks kept in the shared lists
+    void trim();
+} // namespace BlockPool
+
+// for the shared_ptr control blocks of pooled buffers
+template <typename T>
+struct PoolAllocator
+{
+    using value_type = T;
+
+    PoolAllocator() {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &)
+    {
+    }
+
+    T   *allocate(size_t n) { return (T *)BlockPool::alloc(n * sizeof(T)); }
+    void deallocate(T *ptr, size_t n) { BlockPool::release(ptr, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const
+    {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const
+    {
+        return false;
+    }
+};
+
+struct PoolDeleter
+{
+    uint64_t size;
+
+    void operator()(uint8_t *ptr) const { BlockPool::release(ptr, size); }
+};
+
+#endif
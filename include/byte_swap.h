@@ -0,0 +1,169 @@
+#ifndef Z_BYTE_SWAP_H
+#define Z_BYTE_SWAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+
+#ifdef _MSC_VER
+    #include <stdlib.h>
+#endif
+
+enum ENDIAN_E
+{
+    ENDIAN_LITTLE = 0,
+    ENDIAN_BIG    = 1,
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    ENDIAN_HOST = ENDIAN_BIG,
+#else
+    ENDIAN_HOST = ENDIAN_LITTLE,
+#endif
+    ENDIAN_REVERSE = ENDIAN_HOST == ENDIAN_LITTLE ? ENDIAN_BIG : ENDIAN_LITTLE,
+};
+
+static inline uint8_t byte_swap(uint8_t val)
+{
+    return val;
+}
+
+static inline uint16_t byte_swap(uint16_t val)
+{
+#ifdef _MSC_VER
+    return _byteswap_ushort(val);
+#else
+    return __builtin_bswap16(val);
+#endif
+}
+
+static inline uint32_t byte_swap(uint32_t val)
+{
+#ifdef _MSC_VER
+    return _byteswap_ulong(val);
+#else
+    return __builtin_bswap32(val);
+#endif
+}
+
+static inline uint64_t byte_swap(uint64_t val)
+{
+#ifdef _MSC_VER
+    return _byteswap_uint64(val);
+#else
+    return __builtin_bswap64(val);
+#endif
+}
+
+// value stored in endian order -> host order, and back
+template <ENDIAN_E endian, typename T>
+static inline T to_host(T val)
+{
+    static_assert(std::is_integral<T>::value, "integer only");
+
+    if constexpr (endian == ENDIAN_HOST || sizeof(T) == 1)
+    {
+        return val;
+    }
+    else
+    {
+        using U = std::conditional_t<sizeof(T) == 2, uint16_t, std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>;
+        return (T)byte_swap((U)val);
+    }
+}
+
+// N (1~8) bytes integer in endian order at src, one load and one swap
+template <int N, ENDIAN_E endian>
+static inline uint64_t load_un(const void *src)
+{
+    static_assert(N >= 1 && N <= 8, "1~8 bytes");
+
+    uint64_t res = 0;
+    memcpy(&res, src, N);
+
+    if constexpr (ENDIAN_HOST == ENDIAN_LITTLE)
+    {
+        if constexpr (endian == ENDIAN_BIG)
+            res = byte_swap(res) >> (64 - N * 8);
+    }
+    else
+    {
+        if constexpr (endian == ENDIAN_LITTLE)
+            res = byte_swap(res);
+        else
+            res >>= (64 - N * 8);
+    }
+
+    return res;
+}
+
+template <int N, ENDIAN_E endian>
+static inline int64_t load_sn(const void *src)
+{
+    return (int64_t)(load_un<N, endian>(src) << (64 - N * 8)) >> (64 - N * 8);
+}
+
+// store the low N (1~8) bytes of val in endian order at dst
+template <int N, ENDIAN_E endian>
+static inline void store_un(void *dst, uint64_t val)
+{
+    static_assert(N >= 1 && N <= 8, "1~8 bytes");
+
+    if constexpr (ENDIAN_HOST == ENDIAN_LITTLE)
+    {
+        if constexpr (endian == ENDIAN_BIG)
+            val = byte_swap(val << (64 - N * 8));
+    }
+    else
+    {
+        if constexpr (endian == ENDIAN_LITTLE)
+            val = byte_swap(val);
+        else
+            val <<= (64 - N * 8);
+    }
+
+    memcpy(dst, &val, N);
+}
+
+// bulk swap of count elements, SIMD when the cpu has it (avx2/ssse3/neon, picked at runtime).
+// dst and src are either the same buffer (in place) or don't overlap
+void byte_swap_16(uint16_t *dst, const uint16_t *src, size_t count);
+void byte_swap_32(uint32_t *dst, const uint32_t *src, size_t count);
+void byte_swap_64(uint64_t *dst, const uint64_t *src, size_t count);
+
+// name of the kernel set in use: "avx2", "ssse3", "neon" or "scalar"
+const char *byte_swap_impl();
+
+template <typename T>
+static inline void byte_swap_array(T *dst, const T *src, size_t count)
+{
+    static_assert(std::is_integral<T>::value, "integer only");
+
+    if constexpr (sizeof(T) == 1)
+    {
+        if (dst != src)
+            memcpy(dst, src, count);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        byte_swap_16((uint16_t *)dst, (const uint16_t *)src, count);
+    }
+    else if constexpr (sizeof(T) == 4)
+    {
+        byte_swap_32((uint32_t *)dst, (const uint32_t *)src, count);
+    }
+    else
+    {
+        byte_swap_64((uint64_t *)dst, (const uint64_t *)src, count);
+    }
+}
+
+// array stored in endian order -> host order in place
+template <ENDIAN_E endian, typename T>
+static inline void to_host_array(T *data, size_t count)
+{
+    if constexpr (endian != ENDIAN_HOST && sizeof(T) > 1)
+        byte_swap_array(data, data, count);
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef Z_CPU_FEATURES_H
+#define Z_CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define CPU_X86
+    #ifdef _MSC_VER
+        #define TARGET_SSSE3
+        #define TARGET_AVX2
+    #else
+        #define TARGET_SSSE3 __attribute__((target("ssse3")))
+        #define TARGET_AVX2  __attribute__((target("avx2")))
+    #endif
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define CPU_SSE2
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define CPU_NEON
+#endif
+
+// runtime checks for the kernels that need more than the compile time baseline
+bool cpu_has_ssse3();
+bool cpu_has_avx2();
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef Z_LOG_BINARY_H
+#define Z_LOG_BINARY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+
+#include "logger.h"
+
+// layout of a binary log file: header, format table, ring. the ring is cut in blocks, a record never crosses a
+// block, so the decoder can start at any block after the ring wrapped. writers don't wait for each other. a
+// writer lapped by the others drops its record, if it was lapped while copying it may have overwritten part of a
+// newer record, which then fails its checksum and is skipped by the decoder
+#define BINLOG_MAGIC   "ZLOGBIN1"
+#define BINLOG_VERSION 2
+
+static constexpr uint32_t binlog_block_size = 64 * 1024;
+static constexpr uint32_t binlog_max_record = 4096;
+static constexpr uint32_t binlog_pad_id     = 0xffffffff;
+static constexpr uint64_t binlog_table_size = 1024 * 1024;
+static constexpr uint32_t binlog_align      = 8;
+
+struct BinLogHeader
+{
+    char                  magic[8];
+    uint32_t              version;
+    uint32_t              block_size;
+    uint64_t              table_offset;
+    uint64_t              table_size;
+    uint64_t              ring_offset;
+    uint64_t              ring_size;
+    std::atomic<uint64_t> table_used;
+    std::atomic<uint64_t> write_pos; // bytes ever reserved in the ring, a record at pos is at pos % ring_size
+};
+
+// one call site in the table, followed by file, func and fmt without terminators
+struct BinLogFormat
+{
+    uint32_t size; // with the strings, padded to binlog_align
+    uint32_t id;
+    uint32_t line;
+    uint32_t color;
+    uint16_t file_len;
+    uint16_t func_len;
+    uint16_t fmt_len;
+    uint16_t level; // LOG_LEVEL of the call site, LOG_LEVEL_NONE outside the Z_* levels
+};
+
+// one line in the ring, followed by the arguments: a FMT_ARG_TYPE_E byte each, then
+// INT/UINT: size byte and 8 bytes, DOUBLE: 8 bytes, LONG_DOUBLE: sizeof(long double), POINTER: 8 bytes,
+// strings: 4 bytes length and the bytes. other types are stored as the string operator<< makes of them
+struct BinLogRecord
+{
+    uint32_t size; // with the arguments, padded to binlog_align
+    uint32_t id;   // binlog_pad_id for the filler at the end of a block
+    uint64_t pos;  // its own ring position, a stale or half written record doesn't match
+    uint64_t time_us;
+    uint32_t checksum; // of id, pos and the arguments
+    uint32_t reserved;
+};
+
+namespace Log
+{
+    // lines of a binary log file to out, oldest first. lines of call sites above max_level are skipped
+    int bin_decode(const std::string &path, FILE *out, bool show_time = false, LOG_LEVEL max_level = LOG_LEVEL_ALL);
+} // namespace Log
+
+#endif
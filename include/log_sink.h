@@ -0,0 +1,129 @@
+#ifndef Z_LOG_SINK_H
+#define Z_LOG_SINK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "logger.h"
+
+// lines of a FILE, colored when it is a terminal. kept until end_batch(), so the async writer makes one write per
+// batch and a sync line one write
+struct StreamSink : public Log::LogSink
+{
+    explicit StreamSink(FILE *fp = stderr);
+    ~StreamSink();
+
+    void write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len) override;
+    void end_batch() override;
+    void flush() override;
+
+    bool colored() const { return use_color; }
+
+private:
+    void write_buffer();
+
+    FILE      *fp;
+    bool       use_color = false;
+    char      *buffer    = nullptr;
+    size_t     used      = 0;
+    std::mutex mutex;
+
+    static const size_t buffer_size = 64 * 1024;
+};
+
+// buffered lines of a file, without colors. the buffer goes out when it is full, at the end of a batch with a
+// line up to flush_level or when the last write is flush_interval_ms old, on flush() and on destruction
+struct FileSink : public Log::LogSink
+{
+    static const size_t default_buffer_size = 64 * 1024;
+
+    explicit FileSink(const std::string &path, bool append = true, size_t buffer_size = default_buffer_size);
+    ~FileSink();
+
+    bool is_open() const { return fp != nullptr; }
+
+    void write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len) override;
+    void end_batch() override;
+    void flush() override;
+
+    LOG_LEVEL flush_level       = LOG_LEVEL_ERR;
+    uint64_t  flush_interval_ms = 1000;
+
+protected:
+    // with mutex held, before len bytes are added
+    virtual void before_append(size_t len) { (void)len; }
+
+    int  open_file(bool append);
+    void close_file();
+    void write_buffer();
+
+    std::string path;
+    FILE       *fp = nullptr;
+    char       *buffer;
+    size_t      buffer_size;
+    size_t      used          = 0;
+    uint64_t    file_size     = 0; // written to the file, the buffer not counted
+    uint64_t    last_write_ms = 0;
+    bool        urgent        = false; // a line up to flush_level is in the buffer
+    std::mutex  mutex;
+};
+
+// a FileSink that moves path to path.1 (path.1 to path.2 ...) and starts again when the file would pass
+// max_size, or every interval_sec seconds. max_files old files are kept, 0 for either limit turns it off
+struct RotatingFileSink : public FileSink
+{
+    RotatingFileSink(const std::string &path, uint64_t max_size, int max_files = 5, uint64_t interval_sec = 0);
+
+protected:
+    void before_append(size_t len) override;
+
+private:
+    void rotate();
+
+    uint64_t max_size;
+    int      max_files;
+    uint64_t interval_ms;
+    uint64_t opened_ms;
+};
+
+// the last capacity bytes of lines in memory, without colors. dump() writes them oldest first, after
+// install_crash_dump() a crash signal dumps them before the process dies
+struct MemorySink : public Log::LogSink
+{
+    explicit MemorySink(size_t capacity = 1024 * 1024);
+    ~MemorySink();
+
+    void write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len) override;
+
+    void        dump(FILE *fp);
+    std::string contents();
+
+    // SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT dump to path (stderr when empty) then take the default action.
+    // one sink at a time, the last one installed
+    int install_crash_dump(const std::string &path = std::string());
+
+    // the contents as two pieces, oldest first, starting after the first line break once older lines were
+    // overwritten. doesn't lock, the crash handler uses it
+    void segments(const char *&first, size_t &first_len, const char *&second, size_t &second_len) const;
+
+private:
+    char      *ring;
+    size_t     capacity;
+    uint64_t   total = 0; // bytes ever written
+    std::mutex mutex;
+};
+
+namespace Log
+{
+    // used by the logger: a line to every sink that takes its level, end_batch of every sink after it when sync
+    void sinks_write(LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len,
+                     bool end_batch);
+    void sinks_end_batch();
+    void sinks_flush();
+} // namespace Log
+
+#endif
@@ -3,9 +3,15 @@
 
 #define MAX_CMD 4096
 
+#include <stdio.h>
 #include <string.h>
+#include <array>
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <memory>
 #include <iostream>
@@ -29,6 +35,36 @@ enum LOG_LEVEL
     LOG_LEVEL_ALL  = LOG_LEVEL_DBG,
     LOG_LEVEL_BUTT,
 };
+
+enum LOG_COLOR_E
+{
+    LOG_COLOR_NONE = 0,
+    LOG_COLOR_BLUE,
+    LOG_COLOR_GREEN,
+    LOG_COLOR_RED,
+    LOG_COLOR_CYAN,
+    LOG_COLOR_PURPLE,
+    LOG_COLOR_BROWN,
+    LOG_COLOR_DARK_GRAY,
+    LOG_COLOR_LIGHT_BLUE,
+    LOG_COLOR_LIGHT_GREEN,
+    LOG_COLOR_LIGHT_CYAN,
+    LOG_COLOR_LIGHT_RED,
+    LOG_COLOR_YELLOW,
+    LOG_COLOR_LIGHT_PURPLE,
+    LOG_COLOR_LIGHT_GRAY,
+    LOG_COLOR_BLACK,
+    LOG_COLOR_WHITE,
+    LOG_COLOR_BUTT,
+};
+
+// what a log call does when the async queue is full
+enum LOG_OVERFLOW_E
+{
+    LOG_OVERFLOW_BLOCK = 0,   // wait for the writer
+    LOG_OVERFLOW_DROP_NEWEST, // drop the new line
+    LOG_OVERFLOW_DROP_OLDEST, // drop the oldest queued line to make room
+};
 #if defined(_WIN32) || defined(WIN32)
 std::string  stringTransToConsoleCP(const std::string &orig);
 std::wstring stringToWstring(const std::string &orig);
@@ -39,274 +75,537 @@ namespace Log
     void      set_log_level(LOG_LEVEL level);
     LOG_LEVEL get_log_level();
 
-    struct ArgBase
+    // lines go through a lock-free queue of queue_size records to a writer thread that writes them in batches,
+    // log calls don't wait on a slow terminal or pipe. stop_async() writes what is still queued
+    int      start_async(size_t queue_size = 4096, LOG_OVERFLOW_E policy = LOG_OVERFLOW_BLOCK);
+    void     stop_async();
+    bool     is_async();
+    void     flush(); // until everything queued so far is written, and the sinks wrote what they keep
+    uint64_t get_dropped();
+
+    // where lines end up. write() gets whole lines, the first prefix_len bytes are the colored part: the
+    // "[file:line (func)]" of Z_* lines, or all of a Log::red() etc. line. a sink may keep lines until end_batch(),
+    // which the logger calls after every line, or after every batch of the async writer
+    struct LogSink
     {
-        virtual std::string get_ss(std::string var_fmt = std::string()) = 0;
-        virtual ~ArgBase() {}
+        LOG_LEVEL level = LOG_LEVEL_ALL; // Z_* lines above it are skipped, LOG_LEVEL_NONE mutes the sink
+
+        virtual ~LogSink() {}
+
+        virtual void write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len,
+                           size_t len) = 0;
+        virtual void end_batch() {}
+        virtual void flush() {} // everything kept goes out now
     };
 
+    // a stderr sink is there from the start, clear_sinks() removes it too. see log_sink.h for the built-in sinks
+    void add_sink(std::shared_ptr<LogSink> sink);
+    void remove_sink(const std::shared_ptr<LogSink> &sink);
+    void clear_sinks();
+
     template <typename T, typename U>
     struct decay_equiv : std::is_same<std::decay_t<T>, std::decay_t<U>>::type
     {
     };
 
-    template <typename T>
-    struct ArgChar : ArgBase
+    // output of one line, cut at size but len counts everything
+    struct FmtBuffer
     {
-        T arg;
+        char  *data;
+        size_t size;
+        size_t len = 0;
 
-        explicit ArgChar(T val) : arg(val)
+        void append(const char *str, size_t n)
         {
-            static_assert(decay_equiv<T, char>::value || decay_equiv<T, unsigned char>::value, "type error");
+            if (n > 0 && len < size)
+                memcpy(data + len, str, n < size - len ? n : size - len);
+            len += n;
         }
-        ~ArgChar() {}
 
-        std::string get_ss(std::string var_fmt = std::string()) override
+        void append_fill(char c, size_t n)
         {
-            std::ostringstream ss;
-            if (!var_fmt.empty())
-            {
-                char buf[64];
-                snprintf(buf, sizeof(buf), var_fmt.c_str(), arg);
-                ss << buf;
-            }
-            else
-            {
-                ss << (int)arg;
-            }
+            if (n > 0 && len < size)
+                memset(data + len, c, n < size - len ? n : size - len);
+            len += n;
+        }
 
-            return ss.str();
+        template <typename T>
+        void append_printf(const char *fmt, T val)
+        {
+            // size excludes the terminator, there is always room for the one snprintf writes
+            int n = snprintf(len < size ? data + len : nullptr, len < size ? size - len + 1 : 0, fmt, val);
+            if (n > 0)
+                len += n;
+        }
+
+        template <typename T>
+        void append_int(T val, int base = 10)
+        {
+            char tmp[72];
+            auto res = std::to_chars(tmp, tmp + sizeof(tmp), val, base);
+            append(tmp, res.ptr - tmp);
         }
     };
 
-#if defined(WIN32) || defined(_WIN32)
-    template <typename T>
-    struct ArgWString : ArgBase
+    enum FMT_ARG_TYPE_E
     {
-        T arg;
+        FMT_ARG_NONE = 0,
+        FMT_ARG_INT,
+        FMT_ARG_UINT,
+        FMT_ARG_DOUBLE,
+        FMT_ARG_LONG_DOUBLE,
+        FMT_ARG_CSTR,
+        FMT_ARG_STRING,
+        FMT_ARG_POINTER,
+        FMT_ARG_CUSTOM,
+    };
+
+    struct FmtStr
+    {
+        const char *data;
+        size_t      len;
+    };
 
-        explicit ArgWString(T val) : arg(val) { static_assert(decay_equiv<T, std::wstring>::value, "type error"); }
-        ~ArgWString() {}
+    struct FmtCustom
+    {
+        const void *obj;
+        void (*put)(FmtBuffer &out, const void *obj);
+    };
 
-        std::string get_ss(std::string var_fmt = std::string()) override
+    // one argument of a format call, kept by value in an array on the caller's stack. other types point at the
+    // caller's object and are printed through operator<<
+    struct FmtArg
+    {
+        FMT_ARG_TYPE_E type = FMT_ARG_NONE;
+        uint8_t        size = 0; // bytes of an integer, {x} of a negative value keeps its width
+        union
         {
-            (void)var_fmt;
-            return wstringToString(arg);
-        }
+            long long          i;
+            unsigned long long u;
+            double             d;
+            long double        ld;
+            const char        *s;
+            const void        *p;
+            FmtStr             str;
+            FmtCustom          custom;
+        };
+
+        FmtArg() : u(0) {}
     };
-#endif
 
     template <typename T>
-    struct ArgBaseType : ArgBase
+    void fmt_put_stream(FmtBuffer &out, const void *obj)
     {
-        T arg;
+        std::ostringstream ss;
+        ss << *(const T *)obj;
+        std::string str = ss.str();
+        out.append(str.data(), str.size());
+    }
 
-        explicit ArgBaseType(T val) : arg(val) {}
+#if defined(WIN32) || defined(_WIN32)
+    template <typename T>
+    void fmt_put_wstring(FmtBuffer &out, const void *obj)
+    {
+        std::string str = wstringToString(std::wstring(*(const T *)obj));
+        out.append(str.data(), str.size());
+    }
+#endif
 
-        ~ArgBaseType() {}
+    template <typename T>
+    FmtArg make_fmt_arg(const T &arg)
+    {
+        using U = std::decay_t<T>;
+        FmtArg res;
 
-        std::string get_ss(std::string var_fmt = std::string()) override
+        if constexpr (std::is_enum<U>::value)
+            return make_fmt_arg((std::underlying_type_t<U>)arg);
+        else if constexpr (std::is_same<U, bool>::value)
         {
-            std::ostringstream ss;
-            if (!var_fmt.empty())
-            {
-                char buf[64];
-                snprintf(buf, sizeof(buf), var_fmt.c_str(), arg);
-                ss << buf;
-            }
-            else
-            {
-                ss << arg;
-            }
-
-            return ss.str();
+            res.type = FMT_ARG_UINT;
+            res.size = 1;
+            res.u    = arg ? 1 : 0;
+        }
+        else if constexpr (std::is_integral<U>::value && std::is_signed<U>::value)
+        {
+            res.type = FMT_ARG_INT;
+            res.size = sizeof(U);
+            res.i    = arg;
+        }
+        else if constexpr (std::is_integral<U>::value)
+        {
+            res.type = FMT_ARG_UINT;
+            res.size = sizeof(U);
+            res.u    = arg;
+        }
+        else if constexpr (std::is_same<U, long double>::value)
+        {
+            res.type = FMT_ARG_LONG_DOUBLE;
+            res.ld   = arg;
+        }
+        else if constexpr (std::is_floating_point<U>::value)
+        {
+            res.type = FMT_ARG_DOUBLE;
+            res.d    = arg;
+        }
+        else if constexpr (decay_equiv<U, char *>::value || decay_equiv<U, const char *>::value)
+        {
+            res.type = FMT_ARG_CSTR;
+            res.s    = arg;
         }
+        else if constexpr (std::is_same<U, std::string>::value || std::is_same<U, std::string_view>::value)
+        {
+            res.type     = FMT_ARG_STRING;
+            res.str.data = arg.data();
+            res.str.len  = arg.size();
+        }
+#if defined(WIN32) || defined(_WIN32)
+        else if constexpr (std::is_same<U, std::wstring>::value || decay_equiv<U, wchar_t *>::value
+                           || decay_equiv<U, const wchar_t *>::value)
+        {
+            res.type       = FMT_ARG_CUSTOM;
+            res.custom.obj = &arg;
+            res.custom.put = fmt_put_wstring<T>;
+        }
+#endif
+        else if constexpr (std::is_pointer<U>::value)
+        {
+            res.type = FMT_ARG_POINTER;
+            res.p    = (const void *)arg;
+        }
+        else
+        {
+            res.type       = FMT_ARG_CUSTOM;
+            res.custom.obj = &arg;
+            res.custom.put = fmt_put_stream<T>;
+        }
+        return res;
+    }
+
+    // one argument, spec is a printf conversion without the %. a spec that doesn't fit the argument is ignored
+    void fmt_arg_put(FmtBuffer &out, const FmtArg &arg, const char *spec, size_t spec_len);
+
+    // the runtime format, same as format_to below but parsed while printing
+    size_t      vformat_to(char *buf, size_t size, const char *fmt, const FmtArg *args, size_t count);
+    std::string vformat(const char *fmt, const FmtArg *args, size_t count);
+    void        voutput(FILE *fp, const char *fmt, const FmtArg *args, size_t count);
+
+    template <typename... Args>
+    std::string format(const char *fmt, Args &&...args)
+    {
+        const std::array<FmtArg, sizeof...(Args)> arg_list = {make_fmt_arg(args)...};
+        return vformat(fmt, arg_list.data(), arg_list.size());
+    }
+    template <typename... Args>
+    std::string format(const std::string &fmt, Args &&...args)
+    {
+        return format(fmt.c_str(), args...);
+    }
+    template <typename... Args>
+    std::wstring wformat(const char *fmt, Args &&...args)
+    {
+        return stringToWstring(format(fmt, args...));
+    }
+
+    // compile time format strings. LOG_FMT("...") wraps a literal in a type with a constexpr text(), the
+    // placeholders and {spec}s are checked by the compiler and parsed once, the line is built in a stack
+    // buffer. \{ is a literal {
+    struct FmtString
+    {
     };
 
     template <typename T>
-    struct Arg : ArgBase
+    struct is_fmt_string : std::is_base_of<FmtString, std::decay_t<T>>
     {
-        T arg;
+    };
 
-        explicit Arg(T val) : arg(val) {}
+    static constexpr size_t fmt_npos       = (size_t)-1;
+    static constexpr size_t fmt_spec_max   = 16;
+    static constexpr size_t fmt_stack_size = 512;
 
-        ~Arg() {}
+    struct FmtPiece
+    {
+        size_t text_pos = 0; // literal text in front of the argument
+        size_t text_len = 0;
+        size_t spec_pos = 0; // inside the braces, a printf conversion without the %
+        size_t spec_len = 0;
+        int    arg      = -1; // -1 for text only pieces, after an escaped { or at the end
+    };
 
-        std::string get_ss(std::string var_fmt = std::string()) override
+    constexpr bool fmt_has(const char *set, char c)
+    {
+        for (; *set; set++)
         {
-            (void)var_fmt;
-            std::ostringstream ss;
-            ss << arg;
-            return ss.str();
+            if (*set == c)
+                return true;
         }
-    };
+        return false;
+    }
 
-    struct Arguments
+    constexpr size_t fmt_find_close(const char *s, size_t pos)
     {
-        std::vector<std::shared_ptr<ArgBase>> args;
-
-        ~Arguments() {}
+        for (; s[pos]; pos++)
+        {
+            if (s[pos] == '}')
+                return pos;
+        }
+        return fmt_npos;
+    }
 
-        int transfer() { return 0; }
-        template <typename T, typename... Args>
-        int transfer(T arg1, Args &&...args)
+    // placeholders, -1 if a { is never closed
+    constexpr int fmt_arg_count(const char *s)
+    {
+        int count = 0;
+        for (size_t i = 0; s[i]; i++)
         {
-            std::shared_ptr<ArgBase> arg;
-            if constexpr (decay_equiv<T, char>::value || decay_equiv<T, unsigned char>::value)
-            {
-                arg = std::make_shared<ArgChar<T>>(arg1);
-            }
-#if defined(WIN32) || defined(_WIN32)
-            else if constexpr (decay_equiv<T, std::wstring>::value)
+            if (s[i] == '\\' && s[i + 1] == '{')
+                i++;
+            else if (s[i] == '{')
             {
-                arg = std::make_shared<ArgWString<T>>(arg1);
+                i = fmt_find_close(s, i);
+                if (i == fmt_npos)
+                    return -1;
+                count++;
             }
-            else if constexpr (decay_equiv<T, wchar_t *>::value)
+        }
+        return count;
+    }
+
+    constexpr size_t fmt_piece_count(const char *s)
+    {
+        size_t count = 1;
+        for (size_t i = 0; s[i]; i++)
+        {
+            if (s[i] == '\\' && s[i + 1] == '{')
             {
-                arg = std::make_shared<ArgWString<std::wstring>>(std::wstring(arg1));
+                i++;
+                count++;
             }
-#endif
-            else if constexpr (decay_equiv<T, short>::value || decay_equiv<T, unsigned short>::value
-                               || decay_equiv<T, int>::value || decay_equiv<T, unsigned int>::value
-                               || decay_equiv<T, long>::value || decay_equiv<T, unsigned long>::value
-                               || decay_equiv<T, long long>::value || decay_equiv<T, unsigned long long>::value
-                               || decay_equiv<T, float>::value || decay_equiv<T, double>::value
-                               || std::is_pointer<T>::value || std::is_enum<T>::value)
+            else if (s[i] == '{')
             {
-                arg = std::make_shared<ArgBaseType<T>>(arg1);
+                i = fmt_find_close(s, i);
+                count++;
             }
-            else
+        }
+        return count;
+    }
+
+    // conversion of a {spec}: [flags][width][.precision][length]conversion, 0 for {}, -1 if malformed
+    constexpr int fmt_spec_conv(const char *s, size_t pos, size_t len)
+    {
+        if (len == 0)
+            return 0;
+        if (len > fmt_spec_max)
+            return -1;
+
+        size_t end = pos + len;
+        size_t i   = pos;
+        while (i < end && fmt_has("-+ #0", s[i]))
+            i++;
+        while (i < end && s[i] >= '0' && s[i] <= '9')
+            i++;
+        if (i < end && s[i] == '.')
+        {
+            i++;
+            while (i < end && s[i] >= '0' && s[i] <= '9')
+                i++;
+        }
+        while (i < end && fmt_has("hlLqjzt", s[i])) // length modifiers are accepted and ignored
+            i++;
+        if (i + 1 != end || !fmt_has("diouxXeEfFgGaAcsp", s[i]))
+            return -1;
+        return s[i];
+    }
+
+    // conversion of placeholder arg
+    constexpr int fmt_arg_conv(const char *s, int arg)
+    {
+        for (size_t i = 0; s[i]; i++)
+        {
+            if (s[i] == '\\' && s[i + 1] == '{')
+                i++;
+            else if (s[i] == '{')
             {
-                arg = std::make_shared<Arg<T>>(arg1);
+                size_t close = fmt_find_close(s, i);
+                if (arg-- == 0)
+                    return fmt_spec_conv(s, i + 1, close - i - 1);
+                i = close;
             }
-            if (arg == nullptr)
-                return -1;
-
-            this->args.push_back(arg);
-            return transfer(args...);
         }
+        return -1;
+    }
 
-        std::string get_ss(unsigned int idx, std::string var_fmt = std::string())
+    constexpr bool fmt_specs_valid(const char *s)
+    {
+        for (int arg = 0; arg < fmt_arg_count(s); arg++)
         {
-            if (idx >= args.size())
-                return "";
-            return args[idx]->get_ss(var_fmt);
+            if (fmt_arg_conv(s, arg) < 0)
+                return false;
         }
+        return true;
+    }
+
+    template <typename T>
+    struct is_c_string
+        : std::integral_constant<bool, decay_equiv<T, char *>::value || decay_equiv<T, const char *>::value>
+    {
     };
 
-    template <typename... Args>
-    std::string format(const char *fmt, Args &&...args)
+    template <typename T>
+    constexpr bool fmt_conv_fits(int conv)
     {
-        std::ostringstream ss;
-        Arguments          to_args;
-        std::string        fmt_str(fmt);
+        using U = std::decay_t<T>;
+        if (conv == 0)
+            return true;
+        if constexpr (std::is_integral<U>::value || std::is_enum<U>::value)
+            return fmt_has("diouxXc", (char)conv);
+        else if constexpr (std::is_floating_point<U>::value)
+            return fmt_has("eEfFgGaA", (char)conv);
+        else if constexpr (is_c_string<U>::value || std::is_same<U, std::string>::value
+                           || std::is_same<U, std::string_view>::value)
+            return conv == 's';
+        else if constexpr (std::is_pointer<U>::value)
+            return conv == 'p';
+        else
+            return false;
+    }
 
-        int         ret     = 0;
-        const char *end     = fmt + strlen(fmt);
-        const char *pre_pos = fmt;
-        uint64_t    pre_idx = 0;
-        int         arg_idx = 0;
-        const char *c       = fmt;
+    template <typename... Args, size_t... I>
+    constexpr bool fmt_args_fit(const char *s, std::index_sequence<I...>)
+    {
+        (void)s;
+        return (true && ... && fmt_conv_fits<Args>(fmt_arg_conv(s, (int)I)));
+    }
 
-        ret = to_args.transfer(args...);
-        if (ret < 0)
-            return std::string();
+    template <size_t N>
+    constexpr std::array<FmtPiece, N> fmt_parse(const char *s)
+    {
+        std::array<FmtPiece, N> pieces{};
+        size_t                  idx   = 0;
+        size_t                  start = 0;
+        int                     arg   = 0;
+        size_t                  i     = 0;
 
-        while (*c != '\0')
+        for (; s[i]; i++)
         {
-            if ('\\' == *c)
+            if (s[i] == '\\' && s[i + 1] == '{')
             {
-                if ('{' == *(c + 1))
-                {
-                    ss << fmt_str.substr(pre_idx, c - pre_pos);
-                    c++;
-                    pre_pos = c;
-                    pre_idx = c - fmt;
-                }
-                else
-                {
-                    c++;
-                }
+                pieces[idx].text_pos = start;
+                pieces[idx].text_len = i - start;
+                idx++;
+                start = ++i; // the { stays as text
             }
-            else if ('{' == *c)
+            else if (s[i] == '{')
             {
-                uint64_t r_pos = fmt_str.find('}', c - fmt);
-                if (r_pos == std::string::npos)
-                    break;
-                else
-                {
-                    ss << fmt_str.substr(pre_idx, c - pre_pos);
-                    if (r_pos - 1 > (uint64_t)(c - fmt))
-                    {
-                        std::string var_fmt("%");
-                        var_fmt.append(fmt_str.substr(c - fmt + 1, r_pos - 1 + fmt - c));
-                        ss << to_args.get_ss(arg_idx++, var_fmt);
-                    }
-                    else
-                    {
-                        ss << to_args.get_ss(arg_idx++);
-                    }
-
-                    c       = fmt + r_pos + 1;
-                    pre_pos = c;
-                    pre_idx = r_pos + 1;
-                }
-            }
-            else
-            {
-                c++;
+                size_t close         = fmt_find_close(s, i);
+                pieces[idx].text_pos = start;
+                pieces[idx].text_len = i - start;
+                pieces[idx].spec_pos = i + 1;
+                pieces[idx].spec_len = close - i - 1;
+                pieces[idx].arg      = arg++;
+                idx++;
+                start = close + 1;
+                i     = close;
             }
         }
+        pieces[idx].text_pos = start;
+        pieces[idx].text_len = i - start;
+        return pieces;
+    }
 
-        if (pre_pos != end)
-        {
-            ss << fmt_str.substr(pre_idx, end - pre_pos);
-        }
+    // the line into buf (always terminated when size > 0), returns its full length like snprintf
+    template <typename Fmt, typename... Args, std::enable_if_t<is_fmt_string<Fmt>::value, int> = 0>
+    size_t format_to(char *buf, size_t size, Fmt, const Args &...args)
+    {
+        static_assert(fmt_arg_count(Fmt::text()) >= 0, "log format: { without }");
+        static_assert(fmt_arg_count(Fmt::text()) == sizeof...(Args), "log format: placeholders and arguments differ");
+        static_assert(fmt_specs_valid(Fmt::text()),
+                      "log format: {spec} is not [flags][width][.precision][length]conversion");
+        static_assert(fmt_args_fit<Args...>(Fmt::text(), std::index_sequence_for<Args...>()),
+                      "log format: {spec} doesn't fit the argument type");
+
+        static constexpr size_t                      count  = fmt_piece_count(Fmt::text());
+        static constexpr std::array<FmtPiece, count> pieces = fmt_parse<count>(Fmt::text());
+        const char                                  *text   = Fmt::text();
+
+        FmtBuffer out{buf, size ? size - 1 : 0};
+        size_t    idx     = 0;
+        auto      put_arg = [&](const auto &arg) {
+            for (; pieces[idx].arg < 0; idx++)
+                out.append(text + pieces[idx].text_pos, pieces[idx].text_len);
+            out.append(text + pieces[idx].text_pos, pieces[idx].text_len);
+            fmt_arg_put(out, make_fmt_arg(arg), text + pieces[idx].spec_pos, pieces[idx].spec_len);
+            idx++;
+        };
+        (void)put_arg;
+        (put_arg(args), ...);
+        for (; idx < count; idx++)
+            out.append(text + pieces[idx].text_pos, pieces[idx].text_len);
+
+        if (size > 0)
+            buf[out.len < size ? out.len : size - 1] = '\0';
+        return out.len;
+    }
 
-        return ss.str();
+    template <typename... Args>
+    size_t format_to(char *buf, size_t size, const char *fmt, const Args &...args)
+    {
+        const std::array<FmtArg, sizeof...(Args)> arg_list = {make_fmt_arg(args)...};
+        return vformat_to(buf, size, fmt, arg_list.data(), arg_list.size());
     }
     template <typename... Args>
-    std::wstring wformat(const char *fmt, Args &&...args)
+    size_t format_to(char *buf, size_t size, const std::string &fmt, const Args &...args)
     {
-        return stringToWstring(format(fmt, args...));
+        return format_to(buf, size, fmt.c_str(), args...);
     }
 
-#define FORMAT_CSTR(fmt, ...) Log::format(fmt, ##__VA_ARGS__).c_str()
+    template <typename Fmt, typename... Args, std::enable_if_t<is_fmt_string<Fmt>::value, int> = 0>
+    std::string format(Fmt fmt, const Args &...args)
+    {
+        char   buf[fmt_stack_size];
+        size_t len = format_to(buf, sizeof(buf), fmt, args...);
+        if (len < sizeof(buf))
+            return std::string(buf, len);
+
+        std::string str(len, '\0');
+        format_to(&str[0], len + 1, fmt, args...);
+        return str;
+    }
 
-#if defined(WIN32) || defined(_WIN32)
-    #define color_output(l, colorAttributes)                                      \
-        template <typename... Args>                                               \
-        void l(const char *fmt, Args &&...args)                                   \
-        {                                                                         \
-            HANDLE                     hStdout = GetStdHandle(STD_OUTPUT_HANDLE); \
-            CONSOLE_SCREEN_BUFFER_INFO csbiInfo;                                  \
-            GetConsoleScreenBufferInfo(hStdout, &csbiInfo);                       \
-            auto wOldColorAttrs = csbiInfo.wAttributes;                           \
-            SetConsoleTextAttribute(hStdout, colorAttributes);                    \
-            fprintf(stderr, "%s", format(fmt, args...).c_str());                  \
-            SetConsoleTextAttribute(hStdout, wOldColorAttrs);                     \
+    template <typename... Args>
+    void output(FILE *fp, const char *fmt, Args &&...args)
+    {
+        const std::array<FmtArg, sizeof...(Args)> arg_list = {make_fmt_arg(args)...};
+        voutput(fp, fmt, arg_list.data(), arg_list.size());
+    }
+
+    // through a stack buffer, the heap only for lines longer than it
+    template <typename Fmt, typename... Args, std::enable_if_t<is_fmt_string<Fmt>::value, int> = 0>
+    void output(FILE *fp, Fmt fmt, const Args &...args)
+    {
+        char   buf[fmt_stack_size];
+        size_t len = format_to(buf, sizeof(buf), fmt, args...);
+        if (len < sizeof(buf))
+        {
+            fwrite(buf, 1, len, fp);
+            return;
         }
 
-    color_output(blue, FOREGROUND_BLUE);
-    color_output(green, FOREGROUND_GREEN);
-    color_output(red, FOREGROUND_RED);
-    color_output(cyan, FOREGROUND_BLUE | FOREGROUND_GREEN);
-    color_output(purple, FOREGROUND_BLUE | FOREGROUND_RED);
-    color_output(brown, FOREGROUND_GREEN | FOREGROUND_RED);
-    color_output(dark_gray, FOREGROUND_INTENSITY);
-
-    color_output(light_blue, FOREGROUND_BLUE | FOREGROUND_INTENSITY);
-    color_output(light_green, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    color_output(light_red, FOREGROUND_RED | FOREGROUND_INTENSITY);
-    color_output(light_cyan, FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-    color_output(yellow, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
-    color_output(light_purple, FOREGROUND_BLUE | FOREGROUND_RED | FOREGROUND_INTENSITY);
-    color_output(light_gray, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
-
-    color_output(black, 0);
-    color_output(white, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY);
-
-#else
+        std::string str = format(fmt, args...);
+        fwrite(str.data(), 1, str.size(), fp);
+    }
+
+#define LOG_FMT(str)                                            \
+    ([] {                                                       \
+        struct LogFmt : Log::FmtString                          \
+        {                                                       \
+            static constexpr const char *text() { return str; } \
+        };                                                      \
+        return LogFmt();                                        \
+    }())
+
+#define FORMAT_CSTR(fmt, ...) Log::format(fmt, ##__VA_ARGS__).c_str()
+
+#if !defined(WIN32) && !defined(_WIN32)
     #define LOG_NONE         "\033[0m"
     #define LOG_BLACK        "\033[0;30m"
     #define LOG_DARK_GRAY    "\033[1;30m"
@@ -324,16 +623,81 @@ namespace Log
     #define LOG_YELLOW       "\033[1;33m"
     #define LOG_LIGHT_GRAY   "\033[0;37m"
     #define LOG_WHITE        "\033[1;37m"
+#endif
+
+    // a line to the sinks, first prefix_len bytes of it in color. queued for the writer thread when async
+    // logging is on. level is LOG_LEVEL_NONE for lines outside the Z_* levels
+    void write_line(LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len);
+
+    // "[file:line (func)]" of ZM_LOG
+    size_t format_prefix(char *buf, size_t size, const char *file, int line, std::string_view func);
+
+    // the whole line in color, through a stack buffer
+    template <typename Fmt, typename... Args>
+    void color_line(LOG_COLOR_E color, Fmt fmt, const Args &...args)
+    {
+        char   buf[fmt_stack_size];
+        size_t len = format_to(buf, sizeof(buf), fmt, args...);
+        if (len < sizeof(buf))
+        {
+            write_line(LOG_LEVEL_NONE, color, buf, len, len);
+            return;
+        }
 
-    #define color_output(l, u)                                   \
-        template <typename... Args>                              \
-        void l(const char *fmt, Args &&...args)                  \
-        {                                                        \
-            fprintf(stderr, LOG_##u);                            \
-            fprintf(stderr, "%s", format(fmt, args...).c_str()); \
-            fprintf(stderr, LOG_NONE);                           \
+        std::string str = format(fmt, args...);
+        write_line(LOG_LEVEL_NONE, color, str.data(), str.size(), str.size());
+    }
+
+    // the colored prefix and the message in one line
+    template <typename Fmt, typename... Args>
+    void log_line(LOG_LEVEL level, LOG_COLOR_E color, const char *file, int line, std::string_view func, Fmt fmt,
+                  const Args &...args)
+    {
+        char   buf[fmt_stack_size];
+        size_t prefix_len = format_prefix(buf, sizeof(buf), file, line, func);
+        if (prefix_len < sizeof(buf))
+        {
+            size_t len = prefix_len + format_to(buf + prefix_len, sizeof(buf) - prefix_len, fmt, args...);
+            if (len < sizeof(buf))
+            {
+                write_line(level, color, buf, prefix_len, len);
+                return;
+            }
         }
 
+        std::string str(prefix_len, '\0');
+        format_prefix(&str[0], prefix_len + 1, file, line, func);
+        str += format(fmt, args...);
+        write_line(level, color, str.data(), prefix_len, str.size());
+    }
+
+    // binary logging: Z_* lines are kept as a format id and the raw arguments in a ring inside a memory mapped
+    // file, nothing is formatted on the way. binlog_decode turns the file into lines, the oldest are overwritten
+    // once the ring is full
+    int  start_binary(const std::string &path, uint64_t ring_size = 64 * 1024 * 1024);
+    void stop_binary();
+    bool is_binary();
+
+    // a call site gets its id once, the file keeps the format, file, line and function of every id
+    uint32_t bin_register(LOG_LEVEL level, LOG_COLOR_E color, const char *file, int line, std::string_view func,
+                          const char *fmt);
+    void     bin_write(uint32_t id, const FmtArg *args, size_t count);
+
+    template <typename... Args>
+    void bin_log(uint32_t id, const Args &...args)
+    {
+        const std::array<FmtArg, sizeof...(Args)> arg_list = {make_fmt_arg(args)...};
+        bin_write(id, arg_list.data(), arg_list.size());
+    }
+
+#define color_output(l, u)                           \
+    constexpr LOG_COLOR_E l##_color = LOG_COLOR_##u; \
+    template <typename Fmt, typename... Args>        \
+    void l(Fmt fmt, Args &&...args)                  \
+    {                                                \
+        color_line(LOG_COLOR_##u, fmt, args...);     \
+    }
+
     color_output(blue, BLUE);
     color_output(green, GREEN);
     color_output(red, RED);
@@ -353,12 +717,10 @@ namespace Log
     color_output(black, BLACK);
     color_output(white, WHITE);
 
-#endif
-
-    template <typename... Args>
-    void print(const char *fmt, Args &&...args)
+    template <typename Fmt, typename... Args>
+    void print(Fmt fmt, Args &&...args)
     {
-        fprintf(stderr, "%s", format(fmt, args...).c_str());
+        color_line(LOG_COLOR_NONE, fmt, args...);
     }
 }; // namespace Log
 
@@ -407,25 +769,74 @@ std::string                                getBaseName(std::string &&path);
 }
 #define __CLASS_FUNCTION__ _CutParenthesesNTail(__PRETTY_FUNCTION__)
 
-#define LOG_PREFIX(color) Log::color("[{}:{} ({})]", get_file_name(__FILE__), __LINE__, __CLASS_FUNCTION__);
-#define ZM_LOG(color, fmt, ...)         \
-    do                                  \
-    {                                   \
-        LOG_PREFIX(color);              \
-        Log::print(fmt, ##__VA_ARGS__); \
+// the same cut at compile time, for a static constexpr of a call site
+[[maybe_unused]] static constexpr std::string_view cut_function_name(std::string_view s)
+{
+    size_t bracket = s.rfind('(');
+    size_t space   = s.rfind(' ', bracket);
+    space          = space == std::string_view::npos ? 0 : space + 1;
+    return s.substr(space, bracket - space);
+}
+
+#define LOG_PREFIX(color) \
+    Log::color(LOG_FMT("[{}:{} ({})]"), get_file_name(__FILE__), __LINE__, __CLASS_FUNCTION__);
+
+// the function name is cut at compile time, the prefix and the message are written as one line. fmt is parsed
+// while formatting, a runtime string works too. the line is stored formatted when binary logging is on
+#define ZM_LOG_LEVEL(level, color, fmt, ...)                                                                     \
+    do                                                                                                           \
+    {                                                                                                            \
+        static constexpr std::string_view log_func = cut_function_name(__PRETTY_FUNCTION__);                     \
+        if (Log::is_binary())                                                                                    \
+        {                                                                                                        \
+            static const uint32_t log_id =                                                                       \
+                Log::bin_register(level, Log::color##_color, get_file_name(__FILE__), __LINE__, log_func, "{}"); \
+            Log::bin_log(log_id, Log::format(fmt, ##__VA_ARGS__));                                               \
+        }                                                                                                        \
+        else                                                                                                     \
+        {                                                                                                        \
+            Log::log_line(level, Log::color##_color, get_file_name(__FILE__), __LINE__, log_func, fmt,           \
+                          ##__VA_ARGS__);                                                                        \
+        }                                                                                                        \
+    } while (0)
+
+// fmt must be a literal, checked at compile time and formatted without parsing, or stored unformatted when binary
+// logging is on
+#define ZM_LOG_LEVELF(level, color, fmt, ...)                                                                   \
+    do                                                                                                          \
+    {                                                                                                           \
+        static constexpr std::string_view log_func = cut_function_name(__PRETTY_FUNCTION__);                    \
+        if (Log::is_binary())                                                                                   \
+        {                                                                                                       \
+            static const uint32_t log_id =                                                                      \
+                Log::bin_register(level, Log::color##_color, get_file_name(__FILE__), __LINE__, log_func, fmt); \
+            Log::bin_log(log_id, ##__VA_ARGS__);                                                                \
+        }                                                                                                       \
+        else                                                                                                    \
+        {                                                                                                       \
+            Log::log_line(level, Log::color##_color, get_file_name(__FILE__), __LINE__, log_func, LOG_FMT(fmt), \
+                          ##__VA_ARGS__);                                                                       \
+        }                                                                                                       \
     } while (0)
 
-#define ZM_INFO(fmt, ...) ZM_LOG(green, fmt, ##__VA_ARGS__)
-#define ZM_ERR(fmt, ...)  ZM_LOG(red, fmt, ##__VA_ARGS__)
-#define ZM_WARN(fmt, ...) ZM_LOG(yellow, fmt, ##__VA_ARGS__)
-#define ZM_DBG(fmt, ...)  ZM_LOG(blue, fmt, ##__VA_ARGS__)
+#define ZM_LOG(color, fmt, ...)  ZM_LOG_LEVEL(LOG_LEVEL_NONE, color, fmt, ##__VA_ARGS__)
+#define ZM_LOGF(color, fmt, ...) ZM_LOG_LEVELF(LOG_LEVEL_NONE, color, fmt, ##__VA_ARGS__)
+
+#define ZM_INFO(fmt, ...)  ZM_LOG_LEVEL(LOG_LEVEL_INFO, green, fmt, ##__VA_ARGS__)
+#define ZM_ERR(fmt, ...)   ZM_LOG_LEVEL(LOG_LEVEL_ERR, red, fmt, ##__VA_ARGS__)
+#define ZM_WARN(fmt, ...)  ZM_LOG_LEVEL(LOG_LEVEL_WARN, yellow, fmt, ##__VA_ARGS__)
+#define ZM_DBG(fmt, ...)   ZM_LOG_LEVEL(LOG_LEVEL_DBG, blue, fmt, ##__VA_ARGS__)
+#define ZM_INFOF(fmt, ...) ZM_LOG_LEVELF(LOG_LEVEL_INFO, green, fmt, ##__VA_ARGS__)
+#define ZM_ERRF(fmt, ...)  ZM_LOG_LEVELF(LOG_LEVEL_ERR, red, fmt, ##__VA_ARGS__)
+#define ZM_WARNF(fmt, ...) ZM_LOG_LEVELF(LOG_LEVEL_WARN, yellow, fmt, ##__VA_ARGS__)
+#define ZM_DBGF(fmt, ...)  ZM_LOG_LEVELF(LOG_LEVEL_DBG, blue, fmt, ##__VA_ARGS__)
 
 #define Z_ERR(fmt, ...)                            \
     do                                             \
     {                                              \
         if (Log::get_log_level() >= LOG_LEVEL_ERR) \
         {                                          \
-            ZM_LOG(red, fmt, ##__VA_ARGS__);       \
+            ZM_ERR(fmt, ##__VA_ARGS__);            \
         }                                          \
     } while (0)
 
@@ -434,7 +845,7 @@ std::string                                getBaseName(std::string &&path);
     {                                               \
         if (Log::get_log_level() >= LOG_LEVEL_WARN) \
         {                                           \
-            ZM_LOG(yellow, fmt, ##__VA_ARGS__);     \
+            ZM_WARN(fmt, ##__VA_ARGS__);            \
         }                                           \
     } while (0)
 
@@ -443,7 +854,7 @@ std::string                                getBaseName(std::string &&path);
     {                                               \
         if (Log::get_log_level() >= LOG_LEVEL_INFO) \
         {                                           \
-            ZM_LOG(green, fmt, ##__VA_ARGS__);      \
+            ZM_INFO(fmt, ##__VA_ARGS__);            \
         }                                           \
     } while (0)
 
@@ -452,7 +863,44 @@ std::string                                getBaseName(std::string &&path);
     {                                              \
         if (Log::get_log_level() >= LOG_LEVEL_DBG) \
         {                                          \
-            ZM_LOG(blue, fmt, ##__VA_ARGS__);      \
+            ZM_DBG(fmt, ##__VA_ARGS__);            \
+        }                                          \
+    } while (0)
+
+// Z_* with a literal fmt checked at compile time
+#define Z_ERRF(fmt, ...)                           \
+    do                                             \
+    {                                              \
+        if (Log::get_log_level() >= LOG_LEVEL_ERR) \
+        {                                          \
+            ZM_ERRF(fmt, ##__VA_ARGS__);           \
+        }                                          \
+    } while (0)
+
+#define Z_WARNF(fmt, ...)                           \
+    do                                              \
+    {                                               \
+        if (Log::get_log_level() >= LOG_LEVEL_WARN) \
+        {                                           \
+            ZM_WARNF(fmt, ##__VA_ARGS__);           \
+        }                                           \
+    } while (0)
+
+#define Z_INFOF(fmt, ...)                           \
+    do                                              \
+    {                                               \
+        if (Log::get_log_level() >= LOG_LEVEL_INFO) \
+        {                                           \
+            ZM_INFOF(fmt, ##__VA_ARGS__);           \
+        }                                           \
+    } while (0)
+
+#define Z_DBGF(fmt, ...)                           \
+    do                                             \
+    {                                              \
+        if (Log::get_log_level() >= LOG_LEVEL_DBG) \
+        {                                          \
+            ZM_DBGF(fmt, ##__VA_ARGS__);           \
         }                                          \
     } while (0)
 
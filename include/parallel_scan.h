@@ -0,0 +1,104 @@
+#ifndef Z_PARALLEL_SCAN_H
+#define Z_PARALLEL_SCAN_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "binary_file.h"
+#include "myThread.h"
+
+struct ScanChunk
+{
+    int      index = 0;
+    uint64_t start = 0; // on a unit boundary found by the resync hook, 0 for the first chunk
+    uint64_t end   = 0; // start of the next chunk, the file size for the last one
+};
+
+// first unit boundary at or after pos, the file size if none
+using ScanResync = std::function<uint64_t(BinaryReader &reader, uint64_t pos)>;
+
+// first 0x47 at or after pos followed by two more sync bytes 188 bytes apart (or the end of file)
+uint64_t resync_ts_packet(BinaryReader &reader, uint64_t pos);
+
+struct ScanWorker : public MyThread
+{
+    explicit ScanWorker(std::function<void()> job) : job(std::move(job)) {}
+    ~ScanWorker() { stop(); }
+
+protected:
+    void run() override { job(); }
+
+private:
+    std::function<void()> job;
+};
+
+// split file into chunk_count byte ranges, move every split point forward to a unit boundary with resync
+// and call scan(reader, chunk) for each range on thread_count threads (0: one per core). every thread has
+// its own reader attached to file, sharing the file handle. results come back in file order
+template <typename ScanFn>
+auto parallel_scan(BinaryReader &file, int chunk_count, const ScanResync &resync, ScanFn scan, int thread_count = 0)
+    -> std::vector<std::invoke_result_t<ScanFn &, BinaryReader &, const ScanChunk &>>
+{
+    using Result = std::invoke_result_t<ScanFn &, BinaryReader &, const ScanChunk &>;
+
+    std::vector<Result> results;
+    if (!file.opened || chunk_count <= 0)
+        return results;
+
+    if (thread_count <= 0)
+        thread_count = MAX((int)std::thread::hardware_concurrency(), 1);
+    thread_count = MIN(thread_count, chunk_count);
+
+    // one slot per chunk, never a std::vector<bool> whose bits share words between threads
+    std::unique_ptr<Result[]> slots(new Result[chunk_count]());
+
+    std::atomic<int> next_chunk(0);
+    auto             job = [&]() {
+        BinaryReader reader;
+        if (reader.attach(file) < 0)
+            return;
+
+        // boundaries are found again by the neighbouring chunk, resync gives both the same answer
+        auto boundary = [&](int idx) -> uint64_t {
+            if (idx == 0)
+                return 0;
+            if (idx == chunk_count)
+                return file.fileSize;
+            return resync(reader, file.fileSize / chunk_count * idx);
+        };
+
+        for (int idx = next_chunk++; idx < chunk_count; idx = next_chunk++)
+        {
+            ScanChunk chunk;
+            chunk.index = idx;
+            chunk.start = boundary(idx);
+            chunk.end   = MAX(boundary(idx + 1), chunk.start);
+
+            reader.set_cursor(chunk.start);
+            slots[idx] = scan(reader, chunk);
+        }
+    };
+
+    std::vector<std::unique_ptr<ScanWorker>> workers;
+    for (int i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back(new ScanWorker(job));
+        workers.back()->start();
+    }
+    job();
+    for (auto &worker : workers)
+        worker->stop();
+
+    results.reserve(chunk_count);
+    for (int i = 0; i < chunk_count; i++)
+        results.push_back(std::move(slots[i]));
+    return results;
+}
+
+#endif
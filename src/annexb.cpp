@@ -0,0 +1,247 @@
+#include "annexb.h"
+#include "cpu_features.h"
+
+#if defined(CPU_X86)
+    #include <immintrin.h>
+#elif defined(CPU_NEON)
+    #include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+static inline int count_trailing_zeros32(uint32_t val)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, val);
+    return (int)idx;
+#else
+    return __builtin_ctz(val);
+#endif
+}
+
+static size_t find_scalar(const uint8_t *data, size_t size, uint8_t third, size_t start)
+{
+    for (size_t i = start; i + 2 < size; i++)
+    {
+        // a byte above third at i + 2 can't be part of a match starting at i, i + 1 or i + 2,
+        // third being non zero
+        if (data[i + 2] > third)
+        {
+            i += 2;
+            continue;
+        }
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == third)
+            return i;
+    }
+    return size;
+}
+
+// each kernel compares 3 shifted loads, bit j of the mask is a match at i + j
+using find_kernel_t = size_t (*)(const uint8_t *data, size_t size, uint8_t third);
+
+#ifdef CPU_SSE2
+static size_t find_sse2(const uint8_t *data, size_t size, uint8_t third)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i last = _mm_set1_epi8((char)third);
+    size_t        i    = 0;
+
+    for (; i + 18 <= size; i += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), zero);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), zero);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), last);
+        int     m = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+        if (m)
+            return i + count_trailing_zeros32(m);
+    }
+
+    return find_scalar(data, size, third, i);
+}
+#endif
+
+#ifdef CPU_X86
+TARGET_AVX2 static size_t find_avx2(const uint8_t *data, size_t size, uint8_t third)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi8((char)third);
+    size_t        i    = 0;
+
+    for (; i + 34 <= size; i += 32)
+    {
+        __m256i  a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), zero);
+        __m256i  b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), zero);
+        __m256i  c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), last);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+        if (m)
+            return i + count_trailing_zeros32(m);
+    }
+
+    return find_scalar(data, size, third, i);
+}
+#endif
+
+#ifdef CPU_NEON
+static size_t find_neon(const uint8_t *data, size_t size, uint8_t third)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t last = vdupq_n_u8(third);
+    size_t           i    = 0;
+
+    for (; i + 18 <= size; i += 16)
+    {
+        uint8x16_t a = vceqq_u8(vld1q_u8(data + i), zero);
+        uint8x16_t b = vceqq_u8(vld1q_u8(data + i + 1), zero);
+        uint8x16_t c = vceqq_u8(vld1q_u8(data + i + 2), last);
+        if (vmaxvq_u8(vandq_u8(vandq_u8(a, b), c)))
+            return find_scalar(data, i + 18, third, i);
+    }
+
+    return find_scalar(data, size, third, i);
+}
+#endif
+
+#if !defined(CPU_SSE2) && !defined(CPU_NEON)
+static size_t find_none(const uint8_t *data, size_t size, uint8_t third)
+{
+    return find_scalar(data, size, third, 0);
+}
+#endif
+
+static find_kernel_t pick_kernel()
+{
+#ifdef CPU_X86
+    if (cpu_has_avx2())
+        return find_avx2;
+#endif
+#if defined(CPU_SSE2)
+    return find_sse2;
+#elif defined(CPU_NEON)
+    return find_neon;
+#else
+    return find_none;
+#endif
+}
+
+size_t find_00_00_xx(const uint8_t *data, size_t size, uint8_t third)
+{
+    static const find_kernel_t kernel = pick_kernel();
+    return kernel(data, size, third);
+}
+
+// zero bytes right in front of pos, not looking before limit
+uint64_t AnnexBScanner::count_zeros_before(uint64_t pos, uint64_t limit)
+{
+    uint64_t zeros = 0;
+    uint8_t  buf[16];
+
+    while (pos > limit)
+    {
+        uint64_t len = MIN(pos - limit, (uint64_t)sizeof(buf));
+        reader.set_cursor(pos - len);
+        if (reader.read(buf, len) != len)
+            break;
+
+        uint64_t i = len;
+        while (i > 0 && buf[i - 1] == 0)
+            i--;
+        zeros += len - i;
+        if (i > 0)
+            break;
+        pos -= len;
+    }
+
+    return zeros;
+}
+
+// a window at a time, the last 2 bytes of a window are carried over for the start codes across two windows
+uint64_t AnnexBScanner::find_next(uint64_t pos, uint64_t limit, uint64_t &zeros)
+{
+    uint8_t  tail[2];
+    uint64_t tail_len = 0;
+
+    zeros = 0;
+    while (pos < reader.fileSize)
+    {
+        reader.set_cursor(pos);
+        ByteView view = reader.peek_window();
+        if (view.empty())
+            break;
+
+        uint8_t  joint[4];
+        uint64_t joint_len = tail_len;
+        memcpy(joint, tail, tail_len);
+        for (uint64_t i = 0; i < 2 && i < view.size; i++)
+            joint[joint_len++] = view[i];
+
+        uint64_t found = find_start_code(joint, joint_len);
+        if (found < tail_len)
+        {
+            uint64_t code_pos = pos - tail_len + found;
+            zeros             = count_zeros_before(code_pos, limit);
+            return code_pos;
+        }
+
+        found = find_start_code(view.data, view.size);
+        if (found < view.size)
+        {
+            uint64_t i = found;
+            while (i > 0 && pos + i > limit && view[i - 1] == 0)
+                i--;
+            zeros = found - i;
+            if (i == 0 && pos > limit)
+                zeros += count_zeros_before(pos, limit);
+            return pos + found;
+        }
+
+        for (uint64_t i = view.size - MIN(view.size, (uint64_t)2); i < view.size; i++)
+        {
+            if (tail_len == 2)
+            {
+                tail[0]  = tail[1];
+                tail_len = 1;
+            }
+            tail[tail_len++] = view[i];
+        }
+        pos += view.size;
+    }
+
+    return reader.fileSize;
+}
+
+bool AnnexBScanner::next(NalUnitInfo &nal)
+{
+    uint64_t zeros;
+
+    if (!started)
+    {
+        started  = true;
+        next_nal = find_next(next_nal, next_nal, zeros) + 3;
+    }
+
+    if (next_nal >= reader.fileSize)
+        return false;
+
+    uint64_t code_pos = find_next(next_nal, next_nal, zeros);
+
+    nal.offset = next_nal;
+    nal.length = code_pos - next_nal - zeros;
+
+    reader.set_cursor(nal.offset);
+    uint8_t header = reader.read_u8();
+    nal.nal_type   = hevc ? (header >> 1) & 0x3f : header & 0x1f;
+
+    next_nal = code_pos + 3;
+    return true;
+}
+
+uint64_t resync_start_code(BinaryReader &reader, uint64_t pos)
+{
+    AnnexBScanner scanner(reader);
+    uint64_t      zeros;
+
+    return scanner.find_next(pos, pos, zeros);
+}
@@ -0,0 +1,75 @@
+#include "arena.h"
+
+Arena::Arena(size_t block_size, std::pmr::memory_resource *upstream)
+    : block_size(block_size ? block_size : default_block_size), upstream(upstream)
+{
+}
+
+Arena::~Arena()
+{
+    reset();
+    for (auto &block : blocks)
+        upstream->deallocate(block.mem, block.size, block.align);
+}
+
+void *Arena::alloc(size_t size, size_t align)
+{
+    count++;
+    used_size += size;
+
+    if (size + align > block_size)
+    {
+        Block block;
+        block.size  = size;
+        block.align = align;
+        block.mem   = (uint8_t *)upstream->allocate(size, align);
+        oversized.push_back(block);
+        return block.mem;
+    }
+
+    while (cur_block < blocks.size())
+    {
+        uintptr_t base = (uintptr_t)blocks[cur_block].mem;
+        size_t    pos  = (size_t)(((base + cur_pos + align - 1) & ~(uintptr_t)(align - 1)) - base);
+        if (pos + size <= blocks[cur_block].size)
+        {
+            cur_pos = pos + size;
+            return blocks[cur_block].mem + pos;
+        }
+        cur_block++;
+        cur_pos = 0;
+    }
+
+    Block block;
+    block.size  = block_size;
+    block.align = alignof(max_align_t);
+    block.mem   = (uint8_t *)upstream->allocate(block_size, block.align);
+    blocks.push_back(block);
+
+    uintptr_t base = (uintptr_t)block.mem;
+    size_t    pos  = (size_t)(((base + align - 1) & ~(uintptr_t)(align - 1)) - base);
+    cur_pos        = pos + size;
+    return block.mem + pos;
+}
+
+void Arena::reset()
+{
+    for (auto &block : oversized)
+        upstream->deallocate(block.mem, block.size, block.align);
+    oversized.clear();
+
+    cur_block = 0;
+    cur_pos   = 0;
+    used_size = 0;
+    count     = 0;
+}
+
+size_t Arena::capacity() const
+{
+    size_t total = 0;
+    for (auto &block : blocks)
+        total += block.size;
+    for (auto &block : oversized)
+        total += block.size;
+    return total;
+}
@@ -0,0 +1,659 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32)
+    #include <io.h>
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+#if defined(__linux) && __has_include(<linux/io_uring.h>)
+    #define HAVE_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+#endif
+
+#include "async_reader.h"
+#include "logger.h"
+#include "myThread.h"
+
+struct BatchState;
+
+struct ReadTask
+{
+    BatchState  *batch;
+    ReadRequest *req;
+    uint64_t     done = 0;
+#ifdef HAVE_IO_URING
+    struct iovec iov;
+#endif
+};
+
+struct BatchState
+{
+    ReadBatch             requests;
+    std::vector<ReadTask> tasks;
+    std::atomic<size_t>   remaining;
+    ReadBatchCallback     callback;
+};
+
+// the last request of a batch hands it to the callback
+static void complete_task(ReadTask *task)
+{
+    BatchState *batch = task->batch;
+    if (--batch->remaining == 0)
+    {
+        batch->callback(batch->requests);
+        delete batch;
+    }
+}
+
+// len bytes at offset, short at the end of file, -errno on failure
+static int64_t read_file_at(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+    uint64_t total = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file_handle = (HANDLE)_get_osfhandle(fd);
+    while (total < len)
+    {
+        OVERLAPPED ov = {};
+        DWORD      rd = 0;
+        DWORD      sz = (DWORD)MIN(len - total, (uint64_t)0x40000000);
+
+        ov.Offset     = (DWORD)(offset + total);
+        ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+        if (!ReadFile(file_handle, (uint8_t *)buf + total, sz, &rd, &ov))
+        {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            return -EIO;
+        }
+        if (rd == 0)
+            break;
+        total += rd;
+    }
+#else
+    while (total < len)
+    {
+        ssize_t rd = pread(fd, (uint8_t *)buf + total, len - total, offset + total);
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd < 0)
+            return -errno;
+        if (rd == 0)
+            break;
+        total += rd;
+    }
+#endif
+
+    return (int64_t)total;
+}
+
+struct ReadEngine
+{
+    virtual ~ReadEngine() {}
+    virtual void submit(BatchState *batch) = 0;
+    virtual bool is_io_uring() const { return false; }
+};
+
+struct PoolEngine;
+
+struct PoolWorker : public MyThread
+{
+    explicit PoolWorker(PoolEngine *engine) : engine(engine) {}
+    ~PoolWorker() { stop(); }
+
+protected:
+    void run() override;
+
+private:
+    PoolEngine *engine;
+};
+
+struct PoolEngine : public ReadEngine
+{
+    PoolEngine(int fd, int threads) : fd(fd)
+    {
+        for (int i = 0; i < MAX(threads, 1); i++)
+        {
+            workers.emplace_back(new PoolWorker(this));
+            workers.back()->start();
+        }
+    }
+
+    ~PoolEngine()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_all();
+        workers.clear();
+    }
+
+    void submit(BatchState *batch) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &task : batch->tasks)
+                queue.push_back(&task);
+        }
+        cond.notify_all();
+    }
+
+    // worker loop, drains the queue before quitting
+    void work()
+    {
+        for (;;)
+        {
+            ReadTask *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this]() { return quit || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                task = queue.front();
+                queue.pop_front();
+            }
+
+            ReadRequest *req = task->req;
+            req->result      = read_file_at(fd, req->dest.ptr(), req->length, req->offset);
+            complete_task(task);
+        }
+    }
+
+private:
+    int  fd;
+    bool quit = false;
+
+    std::deque<ReadTask *>                   queue;
+    std::vector<std::unique_ptr<PoolWorker>> workers;
+    std::mutex                               mutex;
+    std::condition_variable                  cond;
+};
+
+void PoolWorker::run()
+{
+    engine->work();
+}
+
+#ifdef HAVE_IO_URING
+// raw io_uring without liburing: requests go to the submission ring from the submitting thread,
+// a reaper thread waits for completions and resubmits short reads. reads the ring refuses are done
+// with pread on the thread that pushed them
+struct UringEngine : public ReadEngine, public MyThread
+{
+    static UringEngine *create(int file_fd, int depth)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        int ring_fd = (int)syscall(__NR_io_uring_setup, MAX(depth, 1), &params);
+        if (ring_fd < 0)
+        {
+            Z_WARNF("io_uring not available({}), using pread threads\n", strerror(errno));
+            return nullptr;
+        }
+
+        UringEngine *engine = new UringEngine(ring_fd, file_fd);
+        if (engine->map_rings(params) < 0)
+        {
+            delete engine;
+            return nullptr;
+        }
+        engine->start();
+        return engine;
+    }
+
+    ~UringEngine()
+    {
+        if (sqes)
+        {
+            // wake the reaper with a nop, it quits once everything in flight is back.
+            // a broken ring has no reaper left
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+            if (wait_slot(lock))
+            {
+                io_uring_sqe *sqe = next_sqe();
+                sqe->opcode       = IORING_OP_NOP;
+                commit_sqe();
+                flush();
+            }
+        }
+        stop();
+        unmap_rings();
+        ::close(ring_fd);
+    }
+
+    void submit(BatchState *batch) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (auto &task : batch->tasks)
+            {
+                if (wait_slot(lock))
+                    push_read(&task);
+                else
+                    rejected.push_back(&task);
+            }
+            flush();
+        }
+        finish_rejected();
+    }
+
+    bool is_io_uring() const override { return true; }
+
+protected:
+    void run() override
+    {
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (quit && inflight == 0)
+                    break;
+            }
+
+            int ret = (int)syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            int err = errno;
+            reap();
+            if (ret < 0 && err != EINTR && err != EAGAIN && err != EBUSY)
+            {
+                Z_ERRF("io_uring wait fail({})\n", strerror(err));
+                fail_pending(err);
+                break;
+            }
+        }
+    }
+
+private:
+    UringEngine(int ring_fd, int file_fd) : ring_fd(ring_fd), file_fd(file_fd) {}
+
+    int map_rings(const io_uring_params &params)
+    {
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_len = cq_len = MAX(sq_len, cq_len);
+
+        sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            sq_ptr = nullptr;
+            Z_ERRF("map io_uring fail({})\n", strerror(errno));
+            return -1;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else
+        {
+            cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                          IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+            {
+                cq_ptr = nullptr;
+                Z_ERRF("map io_uring fail({})\n", strerror(errno));
+                return -1;
+            }
+        }
+
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes_ptr =
+            mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+        {
+            Z_ERRF("map io_uring fail({})\n", strerror(errno));
+            return -1;
+        }
+
+        uint8_t *sq = (uint8_t *)sq_ptr;
+        uint8_t *cq = (uint8_t *)cq_ptr;
+
+        sq_entries = params.sq_entries;
+        sq_tail    = (uint32_t *)(sq + params.sq_off.tail);
+        sq_mask    = *(uint32_t *)(sq + params.sq_off.ring_mask);
+        sq_array   = (uint32_t *)(sq + params.sq_off.array);
+        sqes       = (io_uring_sqe *)sqes_ptr;
+        cq_head    = (uint32_t *)(cq + params.cq_off.head);
+        cq_tail    = (uint32_t *)(cq + params.cq_off.tail);
+        cq_mask    = *(uint32_t *)(cq + params.cq_off.ring_mask);
+        cqes       = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    void unmap_rings()
+    {
+        if (sqes)
+            munmap(sqes, sqes_len);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_len);
+        if (sq_ptr)
+            munmap(sq_ptr, sq_len);
+    }
+
+    // no more requests in flight than the submission ring holds, so the completion ring never overflows.
+    // false once the ring is broken. call with mutex held
+    bool wait_slot(std::unique_lock<std::mutex> &lock)
+    {
+        while (!broken && inflight >= sq_entries)
+        {
+            flush();
+            // a failed flush may have freed the slots itself
+            if (inflight >= sq_entries)
+                slot_cond.wait(lock);
+        }
+        if (broken)
+            return false;
+
+        inflight++;
+        return true;
+    }
+
+    io_uring_sqe *next_sqe()
+    {
+        io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void commit_sqe()
+    {
+        sq_array[sq_local_tail & sq_mask] = sq_local_tail & sq_mask;
+        sq_local_tail++;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        to_submit++;
+    }
+
+    // call with mutex held
+    void push_read(ReadTask *task)
+    {
+        ReadRequest *req = task->req;
+
+        task->iov.iov_base = req->dest.ptr() + task->done;
+        task->iov.iov_len  = req->length - task->done;
+
+        io_uring_sqe *sqe = next_sqe();
+        sqe->opcode       = IORING_OP_READV;
+        sqe->fd           = file_fd;
+        sqe->off          = req->offset + task->done;
+        sqe->addr         = (uint64_t)(uintptr_t)&task->iov;
+        sqe->len          = 1;
+        sqe->user_data    = (uint64_t)(uintptr_t)task;
+        commit_sqe();
+        pending.insert(task);
+    }
+
+    // call with mutex held
+    void flush()
+    {
+        while (to_submit > 0)
+        {
+            int ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                Z_ERRF("io_uring submit fail({}), {} reads go to pread\n", strerror(errno), to_submit);
+                take_back();
+                return;
+            }
+            to_submit -= ret;
+        }
+    }
+
+    // the sqes a failed enter left in the ring go back to rejected. without SQPOLL the kernel only reads
+    // the ring in io_uring_enter, so the tail can move back. call with mutex held
+    void take_back()
+    {
+        for (; to_submit > 0; to_submit--)
+        {
+            sq_local_tail--;
+            ReadTask *task = (ReadTask *)(uintptr_t)sqes[sq_local_tail & sq_mask].user_data;
+            inflight--;
+            if (task)
+            {
+                pending.erase(task);
+                rejected.push_back(task);
+            }
+        }
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        slot_cond.notify_all();
+    }
+
+    // the rest of each rejected read through pread, call without mutex held (callbacks may submit)
+    void finish_rejected()
+    {
+        std::vector<ReadTask *> tasks;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.swap(rejected);
+        }
+
+        for (ReadTask *task : tasks)
+        {
+            ReadRequest *req = task->req;
+            int64_t      ret =
+                read_file_at(file_fd, req->dest.ptr() + task->done, req->length - task->done, req->offset + task->done);
+            req->result = ret < 0 ? ret : (int64_t)task->done + ret;
+            complete_task(task);
+        }
+    }
+
+    // the ring can't be waited on anymore: everything in flight fails with err, later submits go to pread
+    void fail_pending(int err)
+    {
+        std::vector<ReadTask *> tasks;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            broken = true;
+            tasks.assign(pending.begin(), pending.end());
+            pending.clear();
+            inflight = 0;
+        }
+        slot_cond.notify_all();
+
+        for (ReadTask *task : tasks)
+        {
+            task->req->result = -err;
+            complete_task(task);
+        }
+    }
+
+    void release_slot(ReadTask *task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            inflight--;
+            if (task)
+                pending.erase(task);
+        }
+        slot_cond.notify_all();
+    }
+
+    void reap()
+    {
+        uint32_t head = *cq_head;
+        uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            io_uring_cqe *cqe  = &cqes[head & cq_mask];
+            ReadTask     *task = (ReadTask *)(uintptr_t)cqe->user_data;
+            int           res  = cqe->res;
+
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            if (!task)
+            {
+                release_slot(nullptr);
+                continue;
+            }
+
+            ReadRequest *req = task->req;
+            if (res == -EINTR || res == -EAGAIN || (res > 0 && task->done + res < req->length))
+            {
+                if (res > 0)
+                    task->done += res;
+                // keeps its slot
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    push_read(task);
+                    flush();
+                }
+                finish_rejected();
+                continue;
+            }
+
+            if (res < 0)
+                req->result = res;
+            else
+                req->result = task->done + res;
+            release_slot(task);
+            complete_task(task);
+        }
+    }
+
+    int  ring_fd;
+    int  file_fd;
+    bool quit   = false;
+    bool broken = false; // a wait failed, the reaper is gone
+
+    void  *sq_ptr   = nullptr;
+    void  *cq_ptr   = nullptr;
+    size_t sq_len   = 0;
+    size_t cq_len   = 0;
+    size_t sqes_len = 0;
+
+    uint32_t      sq_entries    = 0;
+    uint32_t     *sq_tail       = nullptr;
+    uint32_t      sq_mask       = 0;
+    uint32_t     *sq_array      = nullptr;
+    uint32_t      sq_local_tail = 0;
+    io_uring_sqe *sqes          = nullptr;
+    uint32_t     *cq_head       = nullptr;
+    uint32_t     *cq_tail       = nullptr;
+    uint32_t      cq_mask       = 0;
+    io_uring_cqe *cqes          = nullptr;
+
+    uint32_t inflight  = 0;
+    uint32_t to_submit = 0;
+
+    std::unordered_set<ReadTask *> pending;  // pushed to the ring, not completed yet
+    std::vector<ReadTask *>        rejected; // refused by the ring, for finish_rejected()
+
+    std::mutex              mutex;
+    std::condition_variable slot_cond;
+};
+#endif
+
+int AsyncReader::open(std::string &fn, int queue_depth, int threads, bool use_io_uring)
+{
+    close();
+
+    // only the descriptor, the engines read at their own offsets
+#if defined(WIN32) || defined(_WIN32)
+    fd = _open(fn.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    fd = ::open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0)
+    {
+        Z_ERRF("open {} fail({})\n", fn, strerror(errno));
+        return -1;
+    }
+
+#ifdef HAVE_IO_URING
+    if (use_io_uring)
+        engine = UringEngine::create(fd, queue_depth);
+#else
+    (void)queue_depth;
+    (void)use_io_uring;
+#endif
+
+    if (!engine)
+        engine = new PoolEngine(fd, threads);
+
+    return 0;
+}
+
+void AsyncReader::close()
+{
+    if (engine)
+    {
+        delete engine;
+        engine = nullptr;
+    }
+
+    if (fd >= 0)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+    }
+}
+
+bool AsyncReader::is_io_uring() const
+{
+    return engine && engine->is_io_uring();
+}
+
+int AsyncReader::submit(ReadBatch batch, ReadBatchCallback callback)
+{
+    if (!engine)
+        return -1;
+
+    if (batch.empty())
+    {
+        callback(batch);
+        return 0;
+    }
+
+    BatchState *state = new BatchState;
+    state->requests   = std::move(batch);
+    state->callback   = std::move(callback);
+    state->remaining  = state->requests.size();
+    state->tasks.resize(state->requests.size());
+
+    for (size_t i = 0; i < state->requests.size(); i++)
+    {
+        ReadRequest &req = state->requests[i];
+        if (req.dest.length < req.length)
+            req.dest.create_pooled(req.length);
+
+        state->tasks[i].batch = state;
+        state->tasks[i].req   = &req;
+    }
+
+    engine->submit(state);
+    return 0;
+}
+
+std::future<ReadBatch> AsyncReader::submit(ReadBatch batch)
+{
+    auto                   promise = std::make_shared<std::promise<ReadBatch>>();
+    std::future<ReadBatch> result  = promise->get_future();
+
+    if (submit(std::move(batch), [promise](ReadBatch &done) { promise->set_value(std::move(done)); }) < 0)
+        promise->set_value(ReadBatch());
+
+    return result;
+}
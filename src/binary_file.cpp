@@ -28,8 +28,24 @@ using std::string;
     #endif
 #endif
 
+#if defined(WIN32) || defined(_WIN32)
+    #include <io.h>
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+#endif
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 #include "binary_file.h"
 #include "logger.h"
+#include "myThread.h"
+#include "timer.h"
 
 #if defined(WIN32) || defined(_WIN32)
     #define fseek64 _fseeki64
@@ -48,7 +64,9 @@ using file_stat64_t = struct stat64;
 using file_stat64_t = struct stat;
 #endif
 
-void splitpath(std::string &path, std::string &drv, std::string &dir, std::string &name, std::string &ext)
+// assign() straight from path, no temporary strings
+template <typename Str>
+static void split_path(const std::string &path, Str &drv, Str &dir, Str &name, Str &ext)
 {
     uint64_t drv_pos  = path.find(':');
     uint64_t name_pos = path.rfind('/');
@@ -57,21 +75,32 @@ void splitpath(std::string &path, std::string &drv, std::string &dir, std::strin
     uint64_t ext_pos = path.rfind('.');
 
     if (drv_pos != string::npos)
-        drv = path.substr(0, ++drv_pos);
+        drv.assign(path.data(), ++drv_pos);
     else
         drv_pos = 0;
 
     if (name_pos != string::npos)
-        dir = path.substr(drv_pos, ++name_pos - drv_pos);
+        dir.assign(path.data() + drv_pos, ++name_pos - drv_pos);
     else
         name_pos = 0;
 
     if (ext_pos != string::npos)
-        ext = path.substr(ext_pos, path.length() - ext_pos);
+        ext.assign(path.data() + ext_pos, path.length() - ext_pos);
     else
         ext_pos = path.length();
 
-    name = path.substr(name_pos, ext_pos - name_pos);
+    name.assign(path.data() + name_pos, ext_pos - name_pos);
+}
+
+void splitpath(std::string &path, std::string &drv, std::string &dir, std::string &name, std::string &ext)
+{
+    split_path(path, drv, dir, name, ext);
+}
+
+void splitpath(const std::string &path, std::pmr::string &drv, std::pmr::string &dir, std::pmr::string &name,
+               std::pmr::string &ext)
+{
+    split_path(path, drv, dir, name, ext);
 }
 
 uint64_t get_file_size(FILE *fp)
@@ -83,6 +112,479 @@ uint64_t get_file_size(FILE *fp)
     return len;
 }
 
+// positional read that leaves the stdio cursor alone, safe to call from several threads
+static uint64_t pread_file(FILE *fp, void *buf, uint64_t len, uint64_t offset)
+{
+    uint64_t total = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(fp));
+    while (total < len)
+    {
+        OVERLAPPED ov = {};
+        DWORD      rd = 0;
+        DWORD      sz = (DWORD)MIN(len - total, (uint64_t)0x40000000);
+
+        ov.Offset     = (DWORD)(offset + total);
+        ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+        if (!ReadFile(file_handle, (uint8_t *)buf + total, sz, &rd, &ov) || rd == 0)
+            break;
+        total += rd;
+    }
+#else
+    int fd = fileno(fp);
+    while (total < len)
+    {
+        ssize_t rd = pread(fd, (uint8_t *)buf + total, len - total, offset + total);
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            break;
+        total += rd;
+    }
+#endif
+
+    return total;
+}
+
+static uint64_t pwrite_file(FILE *fp, const void *buf, uint64_t len, uint64_t offset)
+{
+    uint64_t total = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(fp));
+    while (total < len)
+    {
+        OVERLAPPED ov = {};
+        DWORD      wr = 0;
+        DWORD      sz = (DWORD)MIN(len - total, (uint64_t)0x40000000);
+
+        ov.Offset     = (DWORD)(offset + total);
+        ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+        if (!WriteFile(file_handle, (const uint8_t *)buf + total, sz, &wr, &ov) || wr == 0)
+            break;
+        total += wr;
+    }
+#else
+    int fd = fileno(fp);
+    while (total < len)
+    {
+        ssize_t wr = pwrite(fd, (const uint8_t *)buf + total, len - total, offset + total);
+        if (wr < 0 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            break;
+        total += wr;
+    }
+#endif
+
+    return total;
+}
+
+// segments back to back from offset with as few calls as the system allows
+static uint64_t pwritev_file(FILE *fp, const std::vector<DataBlock> &segments, uint64_t offset)
+{
+    uint64_t total = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+    for (auto &seg : segments)
+    {
+        uint64_t wr = pwrite_file(fp, seg.ptr(), seg.length, offset + total);
+        total += wr;
+        if (wr != seg.length)
+            break;
+    }
+#else
+    int fd = fileno(fp);
+
+    std::vector<struct iovec> iov(segments.size());
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        iov[i].iov_base = segments[i].ptr();
+        iov[i].iov_len  = segments[i].length;
+    }
+
+    size_t idx = 0;
+    while (idx < iov.size())
+    {
+        int     cnt = (int)MIN(iov.size() - idx, (size_t)IOV_MAX);
+        ssize_t wr  = pwritev(fd, &iov[idx], cnt, offset + total);
+        if (wr < 0 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            break;
+
+        total += wr;
+        // skip what went out, a partial segment continues from where it stopped
+        while (idx < iov.size() && (size_t)wr >= iov[idx].iov_len)
+        {
+            wr -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iov.size())
+        {
+            iov[idx].iov_base = (uint8_t *)iov[idx].iov_base + wr;
+            iov[idx].iov_len -= wr;
+        }
+    }
+#endif
+
+    return total;
+}
+
+struct ReadAheadWindow
+{
+    enum STATE_E
+    {
+        STATE_FREE,
+        STATE_QUEUED,
+        STATE_LOADING,
+        STATE_READY,
+        STATE_IN_USE,
+    };
+
+    uint8_t *data    = nullptr;
+    uint64_t start   = 0;
+    uint64_t size    = 0;
+    STATE_E  state   = STATE_FREE;
+    bool     discard = false; // dropped while loading, free it when the load finishes
+};
+
+// background loader of the windows following the one being parsed
+struct ReadAhead : public MyThread
+{
+    ReadAhead(FILE *fp, uint64_t file_size, uint64_t window_size, int depth)
+        : fp(fp), file_size(file_size), window_size(window_size), windows(depth)
+    {
+        for (auto &window : windows)
+            window.data = new uint8_t[window_size];
+    }
+
+    ~ReadAhead()
+    {
+        stop();
+        for (auto &window : windows)
+            delete[] window.data;
+    }
+
+    // window holding [pos, pos + len), waiting for it if it is still loading.
+    // nullptr if pos is not on the prefetched path, the caller reads it and calls restart()
+    ReadAheadWindow *acquire(uint64_t pos, uint64_t len)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        ReadAheadWindow *found = nullptr;
+        for (auto &window : windows)
+        {
+            if (window.state == ReadAheadWindow::STATE_IN_USE)
+                window.state = ReadAheadWindow::STATE_FREE;
+            else if (window.state != ReadAheadWindow::STATE_FREE && !window.discard && window.start <= pos
+                     && pos + len <= window.start + window.size)
+                found = &window;
+        }
+
+        if (!found)
+            return nullptr;
+
+        cond.wait(lock, [found] { return found->state == ReadAheadWindow::STATE_READY; });
+        found->state = ReadAheadWindow::STATE_IN_USE;
+
+        for (auto &window : windows)
+        {
+            if (window.start < found->start)
+                drop(window);
+        }
+        schedule();
+
+        return found;
+    }
+
+    // prefetch again from pos, after the reader jumped away from the prefetched path
+    void restart(uint64_t pos)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto &window : windows)
+        {
+            if (window.state == ReadAheadWindow::STATE_IN_USE)
+                window.state = ReadAheadWindow::STATE_FREE;
+            drop(window);
+        }
+        next_pos = pos;
+        schedule();
+    }
+
+protected:
+    void run() override
+    {
+        while (1)
+        {
+            ReadAheadWindow *window = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this, &window] {
+                    window = nullptr;
+                    for (auto &w : windows)
+                    {
+                        if (w.state == ReadAheadWindow::STATE_QUEUED && (!window || w.start < window->start))
+                            window = &w;
+                    }
+                    return quit || window;
+                });
+                if (quit)
+                    break;
+                window->state = ReadAheadWindow::STATE_LOADING;
+            }
+
+            uint64_t rd_size = pread_file(fp, window->data, window->size, window->start);
+            if (rd_size != window->size)
+                Z_ERRF("read ahead fail({}), pos {}, size {}\n", strerror(errno), window->start, window->size);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            window->size = rd_size;
+            if (window->discard)
+            {
+                window->state   = ReadAheadWindow::STATE_FREE;
+                window->discard = false;
+            }
+            else
+            {
+                window->state = ReadAheadWindow::STATE_READY;
+            }
+            cond.notify_all();
+        }
+    }
+
+    void stopping() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        cond.notify_all();
+    }
+
+private:
+    // call with mutex held
+    void drop(ReadAheadWindow &window)
+    {
+        if (window.state == ReadAheadWindow::STATE_LOADING)
+            window.discard = true;
+        else if (window.state != ReadAheadWindow::STATE_IN_USE)
+            window.state = ReadAheadWindow::STATE_FREE;
+    }
+
+    // queue free windows behind the prefetched ones, call with mutex held
+    void schedule()
+    {
+        for (auto &window : windows)
+        {
+            if (next_pos >= file_size)
+                break;
+            if (window.state != ReadAheadWindow::STATE_FREE)
+                continue;
+
+            window.start = next_pos;
+            window.size  = MIN(window_size, file_size - next_pos);
+            window.state = ReadAheadWindow::STATE_QUEUED;
+            next_pos += window.size;
+        }
+        cond.notify_all();
+    }
+
+    FILE    *fp;
+    uint64_t file_size;
+    uint64_t window_size;
+    uint64_t next_pos = 0;
+    bool     quit     = false;
+
+    std::vector<ReadAheadWindow> windows;
+    std::mutex                   mutex;
+    std::condition_variable      cond;
+};
+
+#ifdef __linux
+struct MapDeleter
+{
+    uint64_t size;
+
+    void operator()(uint8_t *ptr) const { munmap(ptr, (size_t)size); }
+};
+
+// anonymous mapping on huge pages: reserved ones if any, else transparent huge pages.
+// zero filled, nullptr if even a plain mapping fails
+static uint8_t *map_huge(uint64_t size)
+{
+    void *addr = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED)
+        return (uint8_t *)addr;
+
+    addr = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    #ifdef MADV_HUGEPAGE
+    madvise(addr, (size_t)size, MADV_HUGEPAGE);
+    #endif
+    return (uint8_t *)addr;
+}
+#endif
+
+void DataBlock::create_aligned(uint64_t len, uint64_t align, uint64_t padding)
+{
+    if (align == 0 || (align & (align - 1)))
+        align = default_align;
+
+    length = len;
+    offset = 0;
+
+#ifdef __linux
+    // 2M, the usual huge page size, also keeps any smaller alignment
+    static const uint64_t huge_page_size = 2 * 1024 * 1024;
+    if (len + padding >= huge_threshold && align <= huge_page_size)
+    {
+        uint64_t map_size = (len + padding + huge_page_size - 1) / huge_page_size * huge_page_size;
+        uint8_t *addr     = map_huge(map_size);
+        if (addr)
+        {
+            data = std::shared_ptr<uint8_t[]>(addr, MapDeleter{map_size});
+            return;
+        }
+    }
+#endif
+
+    std::shared_ptr<uint8_t[]> mem(new uint8_t[len + padding + align - 1]);
+    uint8_t *aligned = mem.get() + (align - (uintptr_t)mem.get() % align) % align;
+    memset(aligned + len, 0, padding);
+    data = std::shared_ptr<uint8_t[]>(mem, aligned);
+}
+
+BlockCache::BlockCache(uint64_t capacity, uint64_t page_size)
+    : page_size(MAX(page_size, (uint64_t)1)), max_pages(MAX(capacity / this->page_size, (uint64_t)1))
+{
+}
+
+std::shared_ptr<const uint8_t> BlockCache::get(FILE *fp, uint64_t file_size, uint64_t page_idx, uint64_t &page_len,
+                                               bool *loaded)
+{
+    if (loaded)
+        *loaded = false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto found = pages.find(page_idx);
+        if (found != pages.end())
+        {
+            lru.splice(lru.begin(), lru, found->second);
+            hit_count++;
+            page_len = found->second->len;
+            return found->second->data;
+        }
+    }
+
+    uint64_t start = page_idx * page_size;
+    if (start >= file_size)
+        return nullptr;
+
+    // read without the lock, other readers keep hitting meanwhile
+    Page page;
+    page.idx = page_idx;
+    page.len = MIN(page_size, file_size - start);
+
+    std::shared_ptr<uint8_t[]> mem(new uint8_t[page_size + page_align]);
+    uint8_t *aligned = mem.get() + (page_align - (uintptr_t)mem.get() % page_align) % page_align;
+    if (pread_file(fp, aligned, page.len, start) != page.len)
+        return nullptr;
+    page.data = std::shared_ptr<const uint8_t>(mem, aligned);
+    if (loaded)
+        *loaded = true;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    miss_count++;
+    // another reader loaded it first
+    auto found = pages.find(page_idx);
+    if (found != pages.end())
+    {
+        page_len = found->second->len;
+        return found->second->data;
+    }
+
+    lru.push_front(page);
+    pages[page_idx] = lru.begin();
+    while (pages.size() > max_pages)
+    {
+        pages.erase(lru.back().idx);
+        lru.pop_back();
+        evict_count++;
+    }
+
+    page_len = page.len;
+    return page.data;
+}
+
+bool BlockCache::bind(const std::string &file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (file_name.empty())
+        file_name = file;
+    return file_name == file;
+}
+
+void BlockCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    pages.clear();
+    lru.clear();
+}
+
+double BlockCache::hit_ratio() const
+{
+    uint64_t total = hit_count + miss_count;
+    return total ? (double)hit_count / total : 0;
+}
+
+// window on the cached page holding [read_pos, read_pos + read_size), false if it spans pages
+bool BinaryReader::load_cache_page(uint64_t read_pos, uint64_t read_size)
+{
+    uint64_t page_size = block_cache->get_page_size();
+    uint64_t page_idx  = read_pos / page_size;
+    if ((read_pos + read_size - 1) / page_size != page_idx)
+        return false;
+
+    uint64_t                       page_len;
+    bool                           loaded;
+    std::shared_ptr<const uint8_t> page = block_cache->get(fp, fileSize, page_idx, page_len, &loaded);
+    if (!page)
+        return false;
+
+    cache_page          = page;
+    buffer_ptr          = (uint8_t *)page.get();
+    buffer_start_pos    = page_idx * page_size;
+    buffer_contain_size = page_len;
+    // only a miss read the file
+    if (loaded)
+        bytes_read += page_len;
+    else
+        cache_hits++;
+    return true;
+}
+
+int BinaryReader::set_block_cache(std::shared_ptr<BlockCache> cache)
+{
+    if (!opened)
+        return -1;
+
+    if (cache && !cache->bind(fn))
+    {
+        Z_ERRF("block cache is bound to another file than {}\n", fn);
+        return -1;
+    }
+
+    block_cache = cache;
+    return 0;
+}
+
 int BinaryReader::check_buffer(uint64_t read_pos, uint64_t read_size)
 {
     if (read_pos >= fileSize)
@@ -94,24 +596,213 @@ int BinaryReader::check_buffer(uint64_t read_pos, uint64_t read_size)
 
     if (buffer_start_pos > read_pos || read_pos + can_rd_sz > buffer_start_pos + buffer_contain_size)
     {
-        buffer_contain_size = MIN(fileSize - read_pos, buffer_size);
-        if (fseek64(fp, read_pos, SEEK_SET) < 0)
+        uint64_t start_us = gettime_us();
+
+        buffer_misses++;
+        // sequential scans keep the large window, only jumps go through the cache pages
+        if (block_cache && !continues_window(read_pos) && load_cache_page(read_pos, can_rd_sz))
         {
-            Z_ERR("seek to {#x} fail {}\n", read_pos, strerror(errno));
-            exit(0);
+            io_stall_us += gettime_us() - start_us;
+            return 0;
         }
-        if (fread(read_buffer, 1, buffer_contain_size, fp) != buffer_contain_size)
+        cache_page.reset();
+
+        if (read_ahead)
+        {
+            ReadAheadWindow *window = read_ahead->acquire(read_pos, can_rd_sz);
+            if (window)
+            {
+                buffer_ptr          = window->data;
+                buffer_start_pos    = window->start;
+                buffer_contain_size = window->size;
+                read_ahead_hits++;
+                bytes_read += window->size;
+                io_stall_us += gettime_us() - start_us;
+                return 0;
+            }
+        }
+
+        if (adaptive_min_size)
+            adapt_buffer_size(read_pos);
+
+        uint64_t fill_size = MIN(MAX(buffer_size, can_rd_sz), fileSize);
+        uint64_t start_pos = read_pos;
+        if (refill_policy == REFILL_CENTER)
+            start_pos -= MIN(read_pos, (fill_size - can_rd_sz) / 2);
+        else if (refill_policy == REFILL_BACKWARD)
+            start_pos -= MIN(read_pos, fill_size - can_rd_sz);
+        // a full window at the end of file rather than a short one
+        start_pos = MIN(start_pos, fileSize - fill_size);
+
+        alloc_read_buffer(fill_size);
+        buffer_contain_size = fill_size;
+        if (pread_file(fp, read_buffer, buffer_contain_size, start_pos) != buffer_contain_size)
         {
-            Z_ERR("read {} fail({}), pos {}, size {}\n", fn, strerror(errno), read_pos, buffer_contain_size);
+            Z_ERRF("read {} fail({}), pos {}, size {}\n", fn, strerror(errno), start_pos, buffer_contain_size);
             exit(0);
         }
-        buffer_start_pos = read_pos;
-        Z_DBG("update buffer, pos={#x}, size={}\n", buffer_start_pos, buffer_contain_size);
+        buffer_ptr       = read_buffer;
+        buffer_start_pos = start_pos;
+        bytes_read += buffer_contain_size;
+        Z_DBGF("update buffer, pos={#x}, size={}\n", buffer_start_pos, buffer_contain_size);
+
+        if (read_ahead)
+            read_ahead->restart(buffer_start_pos + buffer_contain_size);
+        io_stall_us += gettime_us() - start_us;
+    }
+    else
+    {
+        buffer_hits++;
     }
     return 0;
 }
 
-int BinaryReader::open(std::string &newFileName)
+// read_pos is in the current window or right after it
+bool BinaryReader::continues_window(uint64_t read_pos) const
+{
+    uint64_t window_end = buffer_start_pos + buffer_contain_size;
+    return buffer_contain_size > 0 && read_pos >= buffer_start_pos && read_pos <= window_end;
+}
+
+void BinaryReader::adapt_buffer_size(uint64_t read_pos)
+{
+    if (continues_window(read_pos))
+        buffer_size = MIN(buffer_size * 2, adaptive_max_size);
+    else
+        buffer_size = MAX(buffer_size / 2, adaptive_min_size);
+}
+
+void BinaryReader::alloc_read_buffer(uint64_t size)
+{
+    if (read_buffer_size >= size)
+        return;
+
+    delete[] read_buffer;
+    read_buffer      = new uint8_t[size];
+    read_buffer_size = size;
+}
+
+void BinaryReader::set_buffer_size(uint64_t size)
+{
+    if (size > 0)
+        buffer_size = MAX(size, min_buffer_size);
+}
+
+void BinaryReader::set_adaptive_buffer(uint64_t min_size, uint64_t max_size)
+{
+    if (min_size > max_size)
+        return;
+
+    if (min_size)
+    {
+        min_size = MAX(min_size, min_buffer_size);
+        max_size = MAX(max_size, min_size);
+    }
+    adaptive_min_size = min_size;
+    adaptive_max_size = max_size;
+    if (min_size)
+        buffer_size = MIN(MAX(buffer_size, min_size), max_size);
+}
+
+int BinaryReader::map_file()
+{
+    if (fileSize == 0 || fileSize > (uint64_t)SIZE_MAX)
+        return -1;
+
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file_handle = (HANDLE)_get_osfhandle(_fileno(fp));
+    HANDLE mapping     = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        Z_WARNF("map {} fail({})\n", fn, GetLastError());
+        return -1;
+    }
+    void *addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!addr)
+    {
+        Z_WARNF("map {} fail({})\n", fn, GetLastError());
+        CloseHandle(mapping);
+        return -1;
+    }
+    map_handle = mapping;
+#else
+    void *addr = mmap(NULL, (size_t)fileSize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (addr == MAP_FAILED)
+    {
+        Z_WARNF("map {} fail({})\n", fn, strerror(errno));
+        return -1;
+    }
+#endif
+
+    map_addr = (uint8_t *)addr;
+    mapped   = true;
+    return 0;
+}
+
+void BinaryReader::unmap_file()
+{
+    if (!mapped)
+        return;
+
+#if defined(WIN32) || defined(_WIN32)
+    UnmapViewOfFile(map_addr);
+    CloseHandle((HANDLE)map_handle);
+    map_handle = nullptr;
+#else
+    munmap(map_addr, (size_t)fileSize);
+#endif
+
+    map_addr = nullptr;
+    mapped   = false;
+}
+
+int BinaryReader::enable_read_ahead(uint64_t window_size, int depth)
+{
+    if (!opened || depth <= 0)
+        return -1;
+
+    if (window_size == 0)
+        window_size = buffer_size;
+
+    disable_read_ahead();
+
+    if (mapped)
+    {
+#if !defined(WIN32) && !defined(_WIN32)
+        madvise(map_addr, (size_t)fileSize, MADV_SEQUENTIAL);
+#endif
+        return 0;
+    }
+
+#ifdef __linux
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    read_ahead = new ReadAhead(fp, fileSize, window_size, depth);
+    read_ahead->restart(buffer_start_pos + buffer_contain_size);
+    read_ahead->start();
+
+    return 0;
+}
+
+void BinaryReader::disable_read_ahead()
+{
+    if (!read_ahead)
+        return;
+
+    delete read_ahead;
+    read_ahead = nullptr;
+
+    // the current window may have belonged to the read ahead
+    if (buffer_ptr != read_buffer)
+    {
+        buffer_ptr          = read_buffer;
+        buffer_start_pos    = 0;
+        buffer_contain_size = 0;
+    }
+}
+
+int BinaryReader::open(std::string &newFileName, bool use_mmap)
 {
     int   ret = 0;
     FILE *tmpfp;
@@ -119,7 +810,7 @@ int BinaryReader::open(std::string &newFileName)
     ret = access(newFileName.c_str(), F_OK | R_OK);
     if (ret != 0)
     {
-        Z_ERR("file ");
+        Z_ERRF("file ");
         Log::blue("{}", newFileName);
         Log::print(" can't access\n");
         goto exit;
@@ -129,7 +820,7 @@ int BinaryReader::open(std::string &newFileName)
     ret = stat64(newFileName.c_str(), &file_state);
     if (ret < 0)
     {
-        Z_ERR("Can't state file ");
+        Z_ERRF("Can't state file ");
         Log::blue("{}\n", newFileName);
         goto exit;
     }
@@ -144,7 +835,7 @@ int BinaryReader::open(std::string &newFileName)
     tmpfp = fopen(newFileName.c_str(), "rb");
     if (!tmpfp)
     {
-        Z_ERR("Can't open file");
+        Z_ERRF("Can't open file");
         Log::blue("{}\n", newFileName);
         ret = -1;
         goto exit;
@@ -164,35 +855,102 @@ int BinaryReader::open(std::string &newFileName)
 
     opened = true;
 
-    if (read_buffer)
+    if (use_mmap && map_file() == 0)
     {
+        // the mapping is one window over the whole file, check_buffer never refills
+        buffer_ptr          = map_addr;
+        buffer_start_pos    = 0;
+        buffer_contain_size = fileSize;
+    }
+    else
+    {
+        alloc_read_buffer(buffer_size);
+
+        buffer_ptr          = read_buffer;
         buffer_contain_size = MIN(fileSize, buffer_size);
         size_t rd_size      = fread(read_buffer, 1, buffer_contain_size, fp);
         if (rd_size != buffer_contain_size)
         {
-            Z_ERR("read err {} != {}\n", rd_size, buffer_contain_size);
+            Z_ERRF("read err {} != {}\n", rd_size, buffer_contain_size);
         }
         buffer_start_pos = 0;
+        bytes_read += rd_size;
     }
 
 exit:
     return ret;
 }
 
+int BinaryReader::attach(const BinaryReader &owner)
+{
+    if (!owner.opened || &owner == this)
+        return -1;
+
+    if (opened)
+        close();
+
+    fn        = owner.fn;
+    drv       = owner.drv;
+    path      = owner.path;
+    base_name = owner.base_name;
+    ext       = owner.ext;
+    fp        = owner.fp;
+    fileSize  = owner.fileSize;
+    _read_pos = 0;
+    opened    = true;
+    attached  = true;
+
+    if (owner.mapped)
+    {
+        map_addr            = owner.map_addr;
+        mapped              = true;
+        buffer_ptr          = map_addr;
+        buffer_start_pos    = 0;
+        buffer_contain_size = fileSize;
+    }
+    else
+    {
+        // empty window, the first read fills it with pread_file, the shared file position is never used
+        buffer_ptr          = read_buffer;
+        buffer_start_pos    = 0;
+        buffer_contain_size = 0;
+    }
+
+    return 0;
+}
+
 int BinaryReader::close()
 {
     opened = false;
 
     if (!fp)
     {
-        Z_ERR("{} not opened", fn);
+        Z_ERRF("{} not opened", fn);
         return -1;
     }
 
+    disable_read_ahead();
+    cache_page.reset();
+    block_cache.reset();
+    buffer_ptr          = nullptr;
+    buffer_start_pos    = 0;
+    buffer_contain_size = 0;
+
+    if (attached)
+    {
+        attached = false;
+        mapped   = false;
+        map_addr = nullptr;
+        fp       = nullptr;
+        return 0;
+    }
+
+    unmap_file();
+
     int ret = fclose(fp);
     if (ret < 0)
     {
-        Z_ERR("{} close fail({})", fn, ret);
+        Z_ERRF("{} close fail({})", fn, ret);
     }
     fp = nullptr;
     return ret;
@@ -215,17 +973,29 @@ uint64_t BinaryReader::read(void *buf, uint64_t len)
 
 uint64_t BinaryReader::jump_read(uint64_t pos, void *buf, uint64_t len)
 {
-    set_file_cursor(pos);
-    uint64_t ret = fread(buf, 1, len, fp);
+    return read_at(pos, buf, len);
+}
+
+uint64_t BinaryReader::read_at(uint64_t offset, void *buf, uint64_t len) const
+{
+    if (!opened || !buf || offset >= fileSize)
+        return 0;
 
-    return ret;
+    uint64_t rd_size = MIN(len, fileSize - offset);
+    if (mapped)
+    {
+        memcpy(buf, map_addr + offset, rd_size);
+        return rd_size;
+    }
+
+    return pread_file(fp, buf, rd_size, offset);
 }
 
 uint64_t BinaryReader::read_still(void *buf, uint64_t len)
 {
     uint64_t rd_size;
 
-    if (len <= buffer_size)
+    if (mapped || len <= buffer_size)
     {
         if (check_buffer(_read_pos, len) < 0)
         {
@@ -233,43 +1003,99 @@ uint64_t BinaryReader::read_still(void *buf, uint64_t len)
         }
 
         rd_size = MIN(len, buffer_contain_size - (_read_pos - buffer_start_pos));
-        memcpy(buf, read_buffer + (_read_pos - buffer_start_pos), len);
+        memcpy(buf, buffer_ptr + (_read_pos - buffer_start_pos), rd_size);
     }
     else
     {
-        fseek64(fp, _read_pos, SEEK_SET);
-        rd_size = fread(buf, 1, len, fp);
+        rd_size = pread_file(fp, buf, MIN(len, fileSize - _read_pos), _read_pos);
+        bytes_read += rd_size;
     }
 
     return rd_size;
 }
 
-string BinaryReader::read_str(uint64_t max_len)
+ByteView BinaryReader::peek_view(uint64_t len)
 {
-    string dst_string;
+    ByteView view;
+
+    if (!mapped)
+        len = MIN(len, buffer_size);
+
+    if (check_buffer(_read_pos, len) < 0)
+        return view;
+
+    uint64_t offset = _read_pos - buffer_start_pos;
+
+    view.data = buffer_ptr + offset;
+    view.size = MIN(len, buffer_contain_size - offset);
+    return view;
+}
+
+ByteView BinaryReader::read_view(uint64_t len)
+{
+    ByteView view = peek_view(len);
+    _read_pos += view.size;
+    return view;
+}
+
+ByteView BinaryReader::peek_window(uint64_t min_len)
+{
+    ByteView view;
+
+    if (!mapped)
+        min_len = MIN(min_len, buffer_size);
+
+    if (check_buffer(_read_pos, min_len) < 0)
+        return view;
+
+    uint64_t offset = _read_pos - buffer_start_pos;
+
+    view.data = buffer_ptr + offset;
+    view.size = buffer_contain_size - offset;
+    return view;
+}
 
+template <typename Str>
+void BinaryReader::read_str_to(Str &dst_string, uint64_t max_len)
+{
     if (max_len > fileSize - _read_pos)
     {
         max_len = fileSize - _read_pos;
     }
 
-    char     c       = 0;
-    uint64_t max_end = _read_pos + max_len;
-
-    dst_string.clear();
-    while (1)
+    // scan whole windows for the terminator instead of reading byte by byte
+    while (max_len > 0)
     {
-        if (_read_pos >= max_end)
+        ByteView view = peek_view(max_len);
+        if (view.empty())
+            break;
+
+        const uint8_t *end     = (const uint8_t *)memchr(view.data, 0, view.size);
+        uint64_t       str_len = end ? end - view.data : view.size;
+
+        dst_string.append((const char *)view.data, str_len);
+        if (end)
         {
+            _read_pos += str_len + 1;
             break;
         }
-        read(&c, 1);
 
-        if (c == 0)
-            break;
-        dst_string.push_back(c);
+        _read_pos += str_len;
+        max_len -= str_len;
     }
+}
+
+string BinaryReader::read_str(uint64_t max_len)
+{
+    string dst_string;
+    read_str_to(dst_string, max_len);
+    return dst_string;
+}
 
+std::pmr::string BinaryReader::read_pstr(uint64_t max_len)
+{
+    std::pmr::string dst_string(arena ? arena : std::pmr::get_default_resource());
+    read_str_to(dst_string, max_len);
     return dst_string;
 }
 
@@ -306,74 +1132,59 @@ uint64_t BinaryReader::read_data(void *buf, uint16_t buf_len, uint16_t data_len,
     return ret;
 }
 
+const uint8_t *BinaryReader::fetch_slow(uint64_t len, uint8_t *tmp)
+{
+    ByteView view = read_view(len);
+    if (view.size == len)
+        return view.data;
+
+    memset(tmp, 0, len);
+    if (view.size > 0)
+        memcpy(tmp, view.data, view.size);
+    return tmp;
+}
+
 uint8_t BinaryReader::read_u8()
 {
-    uint8_t res = 0;
-    read(&res, 1);
-    return res;
+    return read<uint8_t, ENDIAN_HOST>();
 }
 
 int8_t BinaryReader::read_s8()
 {
-    int8_t res = 0;
-    read(&res, 1);
-    return res;
+    return read<int8_t, ENDIAN_HOST>();
 }
 
 uint16_t BinaryReader::read_u16(bool reverse)
 {
-    uint16_t res = 0;
-    read(&res, 2);
-    if (reverse)
-        res = bswap_16(res);
-    return res;
+    return reverse ? read<uint16_t, ENDIAN_REVERSE>() : read<uint16_t, ENDIAN_HOST>();
 }
 
 int16_t BinaryReader::read_s16(bool reverse)
 {
-    int16_t res = 0;
-    read(&res, 2);
-    if (reverse)
-        res = bswap_16(res);
-    return res;
+    return reverse ? read<int16_t, ENDIAN_REVERSE>() : read<int16_t, ENDIAN_HOST>();
 }
 
 uint32_t BinaryReader::read_u32(bool reverse)
 {
-    uint32_t res = 0;
-    read(&res, 4);
-    if (reverse)
-        res = bswap_32(res);
-    return res;
+    return reverse ? read<uint32_t, ENDIAN_REVERSE>() : read<uint32_t, ENDIAN_HOST>();
 }
 
 int32_t BinaryReader::read_s32(bool reverse)
 {
-    int32_t res = 0;
-    read(&res, 4);
-    if (reverse)
-        res = bswap_32(res);
-    return res;
+    return reverse ? read<int32_t, ENDIAN_REVERSE>() : read<int32_t, ENDIAN_HOST>();
 }
 
 uint64_t BinaryReader::read_u64(bool reverse)
 {
-    uint64_t res = 0;
-    read(&res, 8);
-    if (reverse)
-        res = bswap_64(res);
-    return res;
+    return reverse ? read<uint64_t, ENDIAN_REVERSE>() : read<uint64_t, ENDIAN_HOST>();
 }
 
 int64_t BinaryReader::read_s64(bool reverse)
 {
-    int64_t res = 0;
-    read(&res, 8);
-    if (reverse)
-        res = bswap_64(res);
-    return res;
+    return reverse ? read<int64_t, ENDIAN_REVERSE>() : read<int64_t, ENDIAN_HOST>();
 }
 
+// the odd widths have always been composed big endian, reverse gives little endian for them
 uint64_t BinaryReader::read_un(uint16_t bytes, bool reverse)
 {
     switch (bytes)
@@ -386,19 +1197,17 @@ uint64_t BinaryReader::read_un(uint16_t bytes, bool reverse)
             return read_u32(reverse);
         case 8:
             return read_u64(reverse);
+        case 3:
+            return reverse ? read_uN<3, ENDIAN_LITTLE>() : read_uN<3, ENDIAN_BIG>();
+        case 5:
+            return reverse ? read_uN<5, ENDIAN_LITTLE>() : read_uN<5, ENDIAN_BIG>();
+        case 6:
+            return reverse ? read_uN<6, ENDIAN_LITTLE>() : read_uN<6, ENDIAN_BIG>();
+        case 7:
+            return reverse ? read_uN<7, ENDIAN_LITTLE>() : read_uN<7, ENDIAN_BIG>();
         default:
-            uint64_t res = 0;
-            while (bytes > 0)
-            {
-                res = (res << 8) | read_u8();
-                bytes--;
-            }
-            if (reverse)
-            {
-                res = bswap_64(res);
-                res >>= ((8 - bytes) * 8);
-            }
-            return res;
+            read(nullptr, bytes);
+            return 0;
     }
 }
 
@@ -414,19 +1223,17 @@ int64_t BinaryReader::read_sn(uint16_t bytes, bool reverse)
             return read_s32(reverse);
         case 8:
             return read_s64(reverse);
+        case 3:
+            return reverse ? read_sN<3, ENDIAN_LITTLE>() : read_sN<3, ENDIAN_BIG>();
+        case 5:
+            return reverse ? read_sN<5, ENDIAN_LITTLE>() : read_sN<5, ENDIAN_BIG>();
+        case 6:
+            return reverse ? read_sN<6, ENDIAN_LITTLE>() : read_sN<6, ENDIAN_BIG>();
+        case 7:
+            return reverse ? read_sN<7, ENDIAN_LITTLE>() : read_sN<7, ENDIAN_BIG>();
         default:
-            int64_t res = 0;
-            while (bytes > 0)
-            {
-                res = (res << 8) | read_s8();
-                bytes--;
-            }
-            if (reverse)
-            {
-                res = bswap_64(res);
-                res >>= ((8 - bytes) * 8);
-            }
-            return res;
+            read(nullptr, bytes);
+            return 0;
     }
 }
 
@@ -452,3 +1259,345 @@ uint64_t BinaryReader::set_file_cursor(uint64_t abs_offset)
     }
     return act_mov;
 }
+
+int BinaryWriter::open(std::string &newFileName, bool direct_io)
+{
+    FILE *tmpfp  = nullptr;
+    bool  is_direct = false;
+
+#ifdef __linux
+    if (direct_io)
+    {
+        // read access too, patching flushed data in direct mode is a read-modify-write of whole blocks
+        int fd = ::open(newFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd >= 0)
+        {
+            tmpfp = fdopen(fd, "w+b");
+            if (!tmpfp)
+                ::close(fd);
+        }
+        else
+        {
+            Z_WARNF("{} can't be opened with O_DIRECT({}), use normal writes\n", newFileName, strerror(errno));
+        }
+    }
+#endif
+
+    is_direct = tmpfp != nullptr;
+    if (!tmpfp)
+        tmpfp = fopen(newFileName.c_str(), "wb");
+    if (!tmpfp)
+    {
+        Z_ERRF("Can't open file");
+        Log::blue("{}\n", newFileName);
+        return -1;
+    }
+
+    if (opened)
+        close();
+
+    fp     = tmpfp;
+    direct = is_direct;
+    fn     = newFileName;
+
+    if (!buffer_mem)
+    {
+        buffer_mem   = new uint8_t[buffer_size + direct_align];
+        write_buffer = buffer_mem + (direct_align - (uintptr_t)buffer_mem % direct_align) % direct_align;
+    }
+
+    _write_pos       = 0;
+    buffer_start_pos = 0;
+    buffer_fill_size = 0;
+    opened           = true;
+
+    return 0;
+}
+
+int BinaryWriter::close()
+{
+    if (!fp)
+    {
+        Z_ERRF("{} not opened", fn);
+        return -1;
+    }
+
+    int ret = flush_buffer(true);
+
+#ifdef __linux
+    // the last direct block was padded to the alignment
+    if (direct && ftruncate(fileno(fp), _write_pos) < 0)
+    {
+        Z_ERRF("{} truncate to {} fail({})\n", fn, _write_pos, strerror(errno));
+        ret = -1;
+    }
+#endif
+
+    if (fclose(fp) < 0)
+    {
+        Z_ERRF("{} close fail({})", fn, strerror(errno));
+        ret = -1;
+    }
+    fp     = nullptr;
+    opened = false;
+    direct = false;
+    return ret;
+}
+
+int BinaryWriter::flush_buffer(bool final)
+{
+    uint64_t flush_size = buffer_fill_size;
+
+    if (direct)
+    {
+        if (final)
+        {
+            flush_size = (buffer_fill_size + direct_align - 1) / direct_align * direct_align;
+            memset(write_buffer + buffer_fill_size, 0, flush_size - buffer_fill_size);
+        }
+        else
+        {
+            flush_size = buffer_fill_size / direct_align * direct_align;
+        }
+    }
+
+    if (flush_size == 0)
+        return 0;
+
+    flush_count++;
+    if (pwrite_file(fp, write_buffer, flush_size, buffer_start_pos) != flush_size)
+    {
+        Z_ERRF("write {} fail({}), pos {}, size {}\n", fn, strerror(errno), buffer_start_pos, flush_size);
+        return -1;
+    }
+
+    uint64_t remain = buffer_fill_size - MIN(flush_size, buffer_fill_size);
+    if (remain > 0)
+        memmove(write_buffer, write_buffer + flush_size, remain);
+    buffer_start_pos += flush_size;
+    buffer_fill_size = remain;
+
+    return 0;
+}
+
+int BinaryWriter::flush()
+{
+    if (!opened)
+        return -1;
+    return flush_buffer(false);
+}
+
+uint64_t BinaryWriter::write(const void *buf, uint64_t len)
+{
+    if (!opened)
+        return 0;
+
+    // big chunks skip the buffer when nothing is pending in front of them
+    if (!direct && buffer_fill_size == 0 && len >= buffer_size)
+    {
+        flush_count++;
+        uint64_t wr_size = pwrite_file(fp, buf, len, _write_pos);
+        _write_pos += wr_size;
+        buffer_start_pos = _write_pos;
+        return wr_size;
+    }
+
+    uint64_t done = 0;
+    while (done < len)
+    {
+        if (buffer_fill_size == buffer_size && flush_buffer(false) < 0)
+            break;
+
+        uint64_t cp_size = MIN(len - done, buffer_size - buffer_fill_size);
+        memcpy(write_buffer + buffer_fill_size, (const uint8_t *)buf + done, cp_size);
+        buffer_fill_size += cp_size;
+        done += cp_size;
+    }
+
+    _write_pos += done;
+    return done;
+}
+
+uint64_t BinaryWriter::write_chain(const DataChain &chain)
+{
+    if (!opened)
+        return 0;
+
+    if (direct || chain.length < buffer_size)
+    {
+        uint64_t done = 0;
+        for (auto &seg : chain.segments)
+        {
+            uint64_t wr_size = write(seg.ptr(), seg.length);
+            done += wr_size;
+            if (wr_size != seg.length)
+                break;
+        }
+        return done;
+    }
+
+    if (flush_buffer(false) < 0)
+        return 0;
+
+    flush_count++;
+    uint64_t wr_size = pwritev_file(fp, chain.segments, _write_pos);
+    if (wr_size != chain.length)
+    {
+        Z_ERRF("write {} fail({}), pos {}, size {}\n", fn, strerror(errno), _write_pos, chain.length);
+    }
+    _write_pos += wr_size;
+    buffer_start_pos = _write_pos;
+    return wr_size;
+}
+
+uint64_t BinaryWriter::write_u8(uint8_t val)
+{
+    return write(&val, 1);
+}
+
+uint64_t BinaryWriter::write_s8(int8_t val)
+{
+    return write(&val, 1);
+}
+
+uint64_t BinaryWriter::write_u16(uint16_t val, bool reverse)
+{
+    if (reverse)
+        val = bswap_16(val);
+    return write(&val, 2);
+}
+
+uint64_t BinaryWriter::write_s16(int16_t val, bool reverse)
+{
+    return write_u16((uint16_t)val, reverse);
+}
+
+uint64_t BinaryWriter::write_u32(uint32_t val, bool reverse)
+{
+    if (reverse)
+        val = bswap_32(val);
+    return write(&val, 4);
+}
+
+uint64_t BinaryWriter::write_s32(int32_t val, bool reverse)
+{
+    return write_u32((uint32_t)val, reverse);
+}
+
+uint64_t BinaryWriter::write_u64(uint64_t val, bool reverse)
+{
+    if (reverse)
+        val = bswap_64(val);
+    return write(&val, 8);
+}
+
+uint64_t BinaryWriter::write_s64(int64_t val, bool reverse)
+{
+    return write_u64((uint64_t)val, reverse);
+}
+
+// the inverse of BinaryReader::read_un, the odd widths big endian, reverse gives little endian for them
+uint64_t BinaryWriter::write_un(uint64_t val, uint16_t bytes, bool reverse)
+{
+    uint8_t data[8];
+
+    switch (bytes)
+    {
+        case 1:
+            return write_u8((uint8_t)val);
+        case 2:
+            return write_u16((uint16_t)val, reverse);
+        case 4:
+            return write_u32((uint32_t)val, reverse);
+        case 8:
+            return write_u64(val, reverse);
+        case 3:
+            reverse ? store_un<3, ENDIAN_LITTLE>(data, val) : store_un<3, ENDIAN_BIG>(data, val);
+            return write(data, 3);
+        case 5:
+            reverse ? store_un<5, ENDIAN_LITTLE>(data, val) : store_un<5, ENDIAN_BIG>(data, val);
+            return write(data, 5);
+        case 6:
+            reverse ? store_un<6, ENDIAN_LITTLE>(data, val) : store_un<6, ENDIAN_BIG>(data, val);
+            return write(data, 6);
+        case 7:
+            reverse ? store_un<7, ENDIAN_LITTLE>(data, val) : store_un<7, ENDIAN_BIG>(data, val);
+            return write(data, 7);
+        default:
+        {
+            // read_un skips other widths and reads 0, keep the streams in step
+            uint64_t pos = _write_pos;
+            reserve(bytes);
+            return _write_pos - pos;
+        }
+    }
+}
+
+uint64_t BinaryWriter::reserve(uint64_t len)
+{
+    static const uint8_t zeros[64] = {0};
+
+    uint64_t pos = _write_pos;
+    while (len > 0)
+    {
+        uint64_t wr_size = write(zeros, MIN(len, sizeof(zeros)));
+        if (wr_size == 0)
+            break;
+        len -= wr_size;
+    }
+    return pos;
+}
+
+int BinaryWriter::patch_file(uint64_t pos, const void *buf, uint64_t len)
+{
+    if (!direct)
+        return pwrite_file(fp, buf, len, pos) == len ? 0 : -1;
+
+    // O_DIRECT only moves whole aligned blocks
+    uint64_t block_start = pos / direct_align * direct_align;
+    uint64_t block_size  = (pos + len + direct_align - 1) / direct_align * direct_align - block_start;
+
+    std::vector<uint8_t> mem(block_size + direct_align);
+    uint8_t *block = mem.data() + (direct_align - (uintptr_t)mem.data() % direct_align) % direct_align;
+
+    if (pread_file(fp, block, block_size, block_start) != block_size)
+        return -1;
+    memcpy(block + (pos - block_start), buf, len);
+    flush_count++;
+    return pwrite_file(fp, block, block_size, block_start) == block_size ? 0 : -1;
+}
+
+uint64_t BinaryWriter::patch(uint64_t pos, const void *buf, uint64_t len)
+{
+    if (!opened || pos + len > _write_pos)
+    {
+        Z_ERRF("patch {} out of written range {}\n", pos, _write_pos);
+        return 0;
+    }
+
+    uint64_t file_part = pos < buffer_start_pos ? MIN(len, buffer_start_pos - pos) : 0;
+    if (file_part > 0 && patch_file(pos, buf, file_part) < 0)
+    {
+        Z_ERRF("patch {} fail({}), pos {}, size {}\n", fn, strerror(errno), pos, file_part);
+        return 0;
+    }
+
+    if (len > file_part)
+        memcpy(write_buffer + (pos + file_part - buffer_start_pos), (const uint8_t *)buf + file_part, len - file_part);
+
+    return len;
+}
+
+uint64_t BinaryWriter::patch_u32(uint64_t pos, uint32_t val, bool reverse)
+{
+    if (reverse)
+        val = bswap_32(val);
+    return patch(pos, &val, 4);
+}
+
+uint64_t BinaryWriter::patch_u64(uint64_t pos, uint64_t val, bool reverse)
+{
+    if (reverse)
+        val = bswap_64(val);
+    return patch(pos, &val, 8);
+}
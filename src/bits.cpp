@@ -1,64 +1,400 @@
 
+#include "annexb.h"
 #include "bits.h"
-uint8_t BitsReader::read_bit()
+#include "byte_swap.h"
+
+void BitsReader::refill()
 {
-    if (ptr >= size_bits)
-        return 0;
+    uint32_t size_bytes = (size_bits + 7) / 8;
+    uint32_t byte_ptr   = ptr / 8;
+    uint64_t word       = 0;
 
-    uint32_t byte_ptr = ptr / 8;
-    uint8_t  byte     = *(buf + byte_ptr);
+    if (!epb_pos.empty())
+    {
+        word = load_rbsp(byte_ptr);
+    }
+    else if (byte_ptr + 8 <= size_bytes)
+    {
+        word = load_un<8, ENDIAN_BIG>(buf + byte_ptr);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < 8; i++)
+            word = (word << 8) | (byte_ptr + i < size_bytes ? buf[byte_ptr + i] : 0);
+    }
 
-    uint8_t bits_ptr = 7 - ptr % 8;
-    uint8_t res      = (byte >> bits_ptr) & 0x1;
+    cache      = word << (ptr % 8);
+    cache_bits = 64 - ptr % 8;
+    cache_ptr  = ptr;
 
-    ptr++;
-    return res;
+    uint32_t left = ptr < size_bits ? size_bits - ptr : 0;
+    if (left < cache_bits)
+        cache &= left ? ~0ULL << (64 - left) : 0;
 }
 
-uint32_t BitsReader::read_bit(int bits_cnt)
+void BitsReader::find_epb(uint32_t size_bytes)
 {
-    uint32_t res = 0;
-    for (int i = 0; i < bits_cnt; i++)
+    size_t pos = 0;
+    while (pos < size_bytes)
     {
-        uint8_t bit = read_bit();
-        res         = (res << 1) + bit;
+        size_t found = find_emulation_prevention(buf + pos, size_bytes - pos);
+        if (found >= size_bytes - pos)
+            break;
+        epb_pos.push_back((uint32_t)(pos + found + 2));
+        pos += found + 3;
     }
 
-    return res;
+    raw_size  = size_bytes;
+    size_bits = (size_bytes - (uint32_t)epb_pos.size()) * 8;
 }
 
-uint32_t BitsReader::read_golomb()
+// 8 rbsp bytes from rbsp offset byte_ptr, msb first
+uint64_t BitsReader::load_rbsp(uint32_t byte_ptr)
 {
-    int n;
+    // j: emulation prevention bytes in front of byte_ptr, the one at epb_pos[j] is the j-th removed
+    uint32_t lo = 0, hi = (uint32_t)epb_pos.size();
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (epb_pos[mid] - mid <= byte_ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    uint32_t j   = lo;
+    uint32_t raw = byte_ptr + j;
+
+    if (raw + 8 <= raw_size && (j == epb_pos.size() || epb_pos[j] >= raw + 8))
+        return load_un<8, ENDIAN_BIG>(buf + raw);
 
-    for (n = 0; read_bit() == 0 && ptr < size_bits; n++)
-        ;
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        while (j < epb_pos.size() && raw == epb_pos[j])
+        {
+            raw++;
+            j++;
+        }
+        word = (word << 8) | (raw < raw_size ? buf[raw] : 0);
+        raw++;
+    }
+    return word;
+}
 
+// leading zeros of an exp-golomb code, the terminating 1 is consumed too
+uint32_t BitsReader::read_zeros()
+{
+    uint32_t n = 0;
+
+    while (1)
+    {
+        if (cache_ptr != ptr || cache_bits == 0)
+            refill();
+
+        if (cache)
+        {
+            int zeros = count_leading_zeros64(cache);
+            n += zeros;
+            skip_bits(zeros + 1);
+            break;
+        }
+
+        uint32_t left = ptr < size_bits ? size_bits - ptr : 0;
+        if (left <= cache_bits)
+        {
+            // no 1 before the end, the last 0 is taken as the end of the prefix
+            n += left ? left - 1 : 0;
+            skip_bits(left);
+            break;
+        }
+
+        n += cache_bits;
+        skip_bits(cache_bits);
+    }
+
+    return n;
+}
+
+uint32_t BitsReader::read_golomb()
+{
+    int n = read_zeros();
     return ((uint64_t)1 << n) + read_bit(n) - 1;
 }
 
-void BitsWriter::write_bit(uint8_t val)
+// ue(v) of codes up to 9 bits (value 0~30) by the next 9 bits
+struct GolombTable
+{
+    struct
+    {
+        uint8_t len;
+        uint8_t value;
+    } codes[512];
+
+    constexpr GolombTable() : codes()
+    {
+        for (int idx = 0; idx < 512; idx++)
+        {
+            int zeros = 0;
+            while (zeros < 9 && !(idx & (0x100 >> zeros)))
+                zeros++;
+
+            int len = zeros * 2 + 1;
+            if (len > 9)
+            {
+                codes[idx].len   = 0;
+                codes[idx].value = 0;
+                continue;
+            }
+            codes[idx].len   = (uint8_t)len;
+            codes[idx].value = (uint8_t)((idx >> (9 - len)) - 1);
+        }
+    }
+};
+
+static constexpr GolombTable golomb_table;
+
+// value of a short code, -1 when the next code is longer than the table
+inline int BitsReader::read_short_ue()
+{
+    auto &code = golomb_table.codes[peek_bits(9)];
+    if (!code.len || ptr + code.len > size_bits)
+        return -1;
+    skip_bits(code.len);
+    return code.value;
+}
+
+uint64_t BitsReader::read_ue64()
+{
+    int value = read_short_ue();
+    if (value >= 0)
+        return value;
+
+    uint32_t n = read_zeros();
+    if (n > 63)
+        return UINT64_MAX;
+
+    uint64_t suffix = n > 32 ? (uint64_t)read_bit(n - 32) << 32 | read_bit(32) : read_bit(n);
+    return ((uint64_t)1 << n) - 1 + suffix;
+}
+
+int64_t BitsReader::read_se64()
+{
+    uint64_t k = read_ue64();
+    if (k == UINT64_MAX)
+        return INT64_MIN;
+    return (k & 1) ? (int64_t)((k >> 1) + 1) : -(int64_t)(k >> 1);
+}
+
+uint32_t BitsReader::read_ue()
+{
+    int value = read_short_ue();
+    if (value >= 0)
+        return value;
+
+    uint64_t k = read_ue64();
+    return k > UINT32_MAX ? UINT32_MAX : (uint32_t)k;
+}
+
+int32_t BitsReader::read_se()
+{
+    int64_t v = read_se64();
+    if (v > INT32_MAX)
+        return INT32_MAX;
+    if (v < INT32_MIN)
+        return INT32_MIN;
+    return (int32_t)v;
+}
+
+uint32_t BitsReader::read_te(uint32_t range)
+{
+    if (range > 1)
+        return read_ue();
+    return !read_bit();
+}
+
+void BitsReader::read_ue_n(uint32_t *out, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        out[i] = read_ue();
+}
+
+void BitsReader::read_se_n(int32_t *out, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        out[i] = read_se();
+}
+
+bool BitsWriter::grow(uint32_t need_bits)
+{
+    if (storage && need_bits > size_bits)
+    {
+        storage->resize((need_bits + 7) / 8);
+        buf       = storage->data();
+        size_bits = (uint32_t)storage->size() * 8;
+    }
+    return need_bits <= size_bits;
+}
+
+// up to 32 bits msb first with one read-modify-write of the bytes they cover
+void BitsWriter::put_bits(int bits_cnt, uint32_t val)
 {
+    if (rbsp)
+    {
+        put_bits_rbsp(bits_cnt, val);
+        return;
+    }
+
+    if (bits_cnt <= 0)
+        return;
+
+    if (!grow(ptr + bits_cnt))
+        overflow = true;
+
     if (ptr >= size_bits)
         return;
 
-    val = val & 0x1;
+    if ((uint32_t)bits_cnt > size_bits - ptr)
+    {
+        val >>= bits_cnt - (size_bits - ptr);
+        bits_cnt = size_bits - ptr;
+    }
+
+    uint32_t size_bytes = (size_bits + 7) / 8;
+    uint32_t byte_ptr   = ptr / 8;
+    int      shift      = 64 - ptr % 8 - bits_cnt;
+    uint64_t mask       = (((uint64_t)1 << bits_cnt) - 1) << shift;
+    uint64_t word       = 0;
 
-    uint32_t byte_ptr = ptr / 8;
-    uint8_t  byte     = *(buf + byte_ptr);
+    if (byte_ptr + 8 <= size_bytes)
+    {
+        word = load_un<8, ENDIAN_BIG>(buf + byte_ptr);
+        word = (word & ~mask) | (((uint64_t)val << shift) & mask);
+        store_un<8, ENDIAN_BIG>(buf + byte_ptr, word);
+    }
+    else
+    {
+        uint32_t span = (ptr % 8 + bits_cnt + 7) / 8;
+        for (uint32_t i = 0; i < span; i++)
+            word |= (uint64_t)buf[byte_ptr + i] << (56 - i * 8);
+        word = (word & ~mask) | (((uint64_t)val << shift) & mask);
+        for (uint32_t i = 0; i < span; i++)
+            buf[byte_ptr + i] = (uint8_t)(word >> (56 - i * 8));
+    }
+
+    ptr += bits_cnt;
+}
+
+void BitsWriter::put_bits_rbsp(int bits_cnt, uint32_t val)
+{
+    if (bits_cnt <= 0)
+        return;
+
+    rbsp_acc = (rbsp_acc << bits_cnt) | (val & (((uint64_t)1 << bits_cnt) - 1));
+    rbsp_acc_bits += bits_cnt;
+    ptr += bits_cnt;
+
+    while (rbsp_acc_bits >= 8)
+    {
+        rbsp_acc_bits -= 8;
+        emit_byte((uint8_t)(rbsp_acc >> rbsp_acc_bits));
+    }
+}
+
+// a byte that doesn't fit stops the output, so it stays a valid prefix of the payload
+void BitsWriter::emit_byte(uint8_t val)
+{
+    if (overflow)
+        return;
+
+    bool escape = zero_run >= 2 && val <= 0x03;
+    if (!grow((out_size + 1 + escape) * 8))
+    {
+        overflow = true;
+        return;
+    }
 
-    uint8_t bits_ptr = 7 - ptr % 8;
-    uint8_t res      = (byte & (~(0x01 << bits_ptr))) + (val << bits_ptr);
+    if (escape)
+    {
+        buf[out_size++] = 0x03;
+        zero_run        = 0;
+    }
+    buf[out_size++] = val;
+    zero_run        = val ? 0 : zero_run + 1;
+}
 
-    *(buf + byte_ptr) = res;
-    ptr++;
+void BitsWriter::write_bit(uint8_t val)
+{
+    put_bits(1, val & 0x1);
 }
 
 void BitsWriter::write_bit(int bits_cnt, uint64_t val)
 {
-    for (int i = 0; i < bits_cnt; i++)
+    // bits above the 64 of val are leading zeros, put_bits takes at most 32 at once
+    while (bits_cnt > 64)
+    {
+        int cnt = bits_cnt - 64 > 32 ? 32 : bits_cnt - 64;
+        put_bits(cnt, 0);
+        bits_cnt -= cnt;
+    }
+    if (bits_cnt > 32)
+    {
+        put_bits(bits_cnt - 32, (uint32_t)(val >> 32));
+        bits_cnt = 32;
+    }
+    put_bits(bits_cnt, (uint32_t)val);
+}
+
+void BitsWriter::write_ue(uint64_t val)
+{
+    if (val == UINT64_MAX)
+    {
+        // 64 leading zeros, longer than BitsReader::read_ue64 takes
+        write_bit(64, 0);
+        write_bit(1);
+        write_bit(64, 0);
+        return;
+    }
+
+    uint64_t code  = val + 1;
+    int      zeros = 63 - count_leading_zeros64(code);
+
+    write_bit(zeros, 0);
+    write_bit(zeros + 1, code);
+}
+
+void BitsWriter::write_se(int64_t val)
+{
+    if (val == INT64_MIN)
+    {
+        // codeNum 2^64 doesn't fit a uint64_t: 64 leading zeros, then 2^64 + 1 in 65 bits
+        write_bit(64, 0);
+        write_bit(1);
+        write_bit(64, 1);
+        return;
+    }
+
+    write_ue(val > 0 ? (uint64_t)val * 2 - 1 : (uint64_t)0 - (uint64_t)val * 2);
+}
+
+void BitsWriter::byte_align(uint8_t fill)
+{
+    int pad = (8 - ptr % 8) % 8;
+    put_bits(pad, fill ? 0xff : 0);
+}
+
+void BitsWriter::finish_rbsp()
+{
+    if (!rbsp)
+        return;
+
+    byte_align(0);
+    if (zero_run > 0 && !overflow)
     {
-        uint8_t bit = (val >> (bits_cnt - 1 - i)) & 0x1;
-        write_bit(bit);
+        if (grow((out_size + 1) * 8))
+            buf[out_size++] = 0x03;
+        else
+            overflow = true;
+        zero_run = 0;
     }
 }
@@ -0,0 +1,202 @@
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "bits.h"
+#include "block_pool.h"
+
+namespace BlockPool
+{
+    static const int      min_shift   = 6;  // 64 bytes
+    static const int      max_shift   = 24; // 16M
+    static const int      class_count = max_shift - min_shift + 1;
+    static const uint64_t cache_bytes = 1024 * 1024;      // per thread and class
+    static const uint64_t list_bytes  = 64 * 1024 * 1024; // per shared list
+
+    // 0 ~ class_count-1, class_count for sizes too large to pool
+    static int size_class(uint64_t size)
+    {
+        if (size <= ((uint64_t)1 << min_shift))
+            return 0;
+        if (size > ((uint64_t)1 << max_shift))
+            return class_count;
+
+        int shift = 64 - count_leading_zeros64(size - 1);
+        return shift - min_shift;
+    }
+
+    static uint64_t class_size(int idx)
+    {
+        return (uint64_t)1 << (idx + min_shift);
+    }
+
+    // blocks a cache or list holds at most for a class
+    static size_t class_limit(int idx, uint64_t bytes)
+    {
+        return (size_t)(bytes / class_size(idx) < 2 ? 2 : bytes / class_size(idx));
+    }
+
+    struct SharedList
+    {
+        std::mutex          mutex;
+        std::vector<void *> blocks;
+    };
+
+    struct Pool
+    {
+        SharedList lists[class_count];
+
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> releases{0};
+        std::atomic<uint64_t> cached{0};
+        std::atomic<uint64_t> thread_hit{0};
+    };
+
+    // never destroyed, blocks may come back during static destruction
+    static Pool &pool()
+    {
+        static Pool *instance = new Pool;
+        return *instance;
+    }
+
+    static void *take_shared(int idx)
+    {
+        SharedList &list = pool().lists[idx];
+
+        std::lock_guard<std::mutex> lock(list.mutex);
+        if (list.blocks.empty())
+            return nullptr;
+
+        void *ptr = list.blocks.back();
+        list.blocks.pop_back();
+        pool().cached -= class_size(idx);
+        return ptr;
+    }
+
+    static void give_shared(int idx, void *ptr)
+    {
+        SharedList &list = pool().lists[idx];
+        {
+            std::lock_guard<std::mutex> lock(list.mutex);
+            if (list.blocks.size() < class_limit(idx, list_bytes))
+            {
+                list.blocks.push_back(ptr);
+                pool().cached += class_size(idx);
+                return;
+            }
+        }
+        ::operator delete(ptr);
+    }
+
+    static thread_local bool cache_gone = false;
+
+    struct ThreadCache
+    {
+        std::vector<void *> blocks[class_count];
+
+        ~ThreadCache()
+        {
+            for (int idx = 0; idx < class_count; idx++)
+            {
+                for (void *ptr : blocks[idx])
+                    give_shared(idx, ptr);
+            }
+            cache_gone = true;
+        }
+    };
+
+    // nullptr once the thread is exiting
+    static ThreadCache *thread_cache()
+    {
+        if (cache_gone)
+            return nullptr;
+
+        static thread_local ThreadCache cache;
+        return &cache;
+    }
+
+    void *alloc(uint64_t size)
+    {
+        int idx = size_class(size);
+        if (idx == class_count)
+        {
+            pool().misses++;
+            return ::operator new((size_t)size);
+        }
+
+        ThreadCache *cache = thread_cache();
+        if (cache && !cache->blocks[idx].empty())
+        {
+            void *ptr = cache->blocks[idx].back();
+            cache->blocks[idx].pop_back();
+            pool().hits.fetch_add(1, std::memory_order_relaxed);
+            pool().thread_hit.fetch_add(1, std::memory_order_relaxed);
+            return ptr;
+        }
+
+        void *ptr = take_shared(idx);
+        if (ptr)
+        {
+            pool().hits.fetch_add(1, std::memory_order_relaxed);
+            return ptr;
+        }
+
+        pool().misses.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new((size_t)class_size(idx));
+    }
+
+    void release(void *ptr, uint64_t size)
+    {
+        if (!ptr)
+            return;
+
+        pool().releases.fetch_add(1, std::memory_order_relaxed);
+
+        int idx = size_class(size);
+        if (idx == class_count)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+
+        ThreadCache *cache = thread_cache();
+        if (cache && cache->blocks[idx].size() < class_limit(idx, cache_bytes))
+        {
+            // reserve up front, the cache itself must not allocate in the steady state
+            if (cache->blocks[idx].capacity() == 0)
+                cache->blocks[idx].reserve(class_limit(idx, cache_bytes));
+            cache->blocks[idx].push_back(ptr);
+            return;
+        }
+
+        give_shared(idx, ptr);
+    }
+
+    Stats get_stats()
+    {
+        Stats stats;
+
+        stats.hits       = pool().hits;
+        stats.misses     = pool().misses;
+        stats.releases   = pool().releases;
+        stats.cached     = pool().cached;
+        stats.thread_hit = pool().thread_hit;
+        return stats;
+    }
+
+    void trim()
+    {
+        for (int idx = 0; idx < class_count; idx++)
+        {
+            SharedList &list = pool().lists[idx];
+
+            std::lock_guard<std::mutex> lock(list.mutex);
+            for (void *ptr : list.blocks)
+                ::operator delete(ptr);
+            pool().cached -= list.blocks.size() * class_size(idx);
+            list.blocks.clear();
+        }
+    }
+} // namespace BlockPool
@@ -0,0 +1,147 @@
+#include "byte_swap.h"
+#include "cpu_features.h"
+
+#if defined(CPU_X86)
+    #define BSWAP_X86
+    #include <immintrin.h>
+#elif defined(CPU_NEON)
+    #define BSWAP_NEON
+    #include <arm_neon.h>
+#endif
+
+// byte order inside one 16 bytes lane for 2/4/8 bytes elements
+alignas(32) static const uint8_t shuffle_mask[3][32] = {
+    {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8},
+};
+
+// swap whole vectors of bytes, returns how many bytes were done, the caller finishes the tail
+using swap_kernel_t = size_t (*)(uint8_t *dst, const uint8_t *src, size_t bytes, const uint8_t *mask);
+
+static size_t swap_none(uint8_t *, const uint8_t *, size_t, const uint8_t *)
+{
+    return 0;
+}
+
+#ifdef BSWAP_X86
+TARGET_SSSE3 static size_t swap_ssse3(uint8_t *dst, const uint8_t *src, size_t bytes, const uint8_t *mask)
+{
+    __m128i shuffle = _mm_load_si128((const __m128i *)mask);
+    size_t  i       = 0;
+
+    for (; i + 64 <= bytes; i += 64)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v0, shuffle));
+        _mm_storeu_si128((__m128i *)(dst + i + 16), _mm_shuffle_epi8(v1, shuffle));
+        _mm_storeu_si128((__m128i *)(dst + i + 32), _mm_shuffle_epi8(v2, shuffle));
+        _mm_storeu_si128((__m128i *)(dst + i + 48), _mm_shuffle_epi8(v3, shuffle));
+    }
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+
+    return i;
+}
+
+TARGET_AVX2 static size_t swap_avx2(uint8_t *dst, const uint8_t *src, size_t bytes, const uint8_t *mask)
+{
+    __m256i shuffle = _mm256_load_si256((const __m256i *)mask);
+    size_t  i       = 0;
+
+    for (; i + 128 <= bytes; i += 128)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v0, shuffle));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_shuffle_epi8(v1, shuffle));
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), _mm256_shuffle_epi8(v2, shuffle));
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), _mm256_shuffle_epi8(v3, shuffle));
+    }
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+
+    return i;
+}
+#endif
+
+#ifdef BSWAP_NEON
+static size_t swap_neon(uint8_t *dst, const uint8_t *src, size_t bytes, const uint8_t *mask)
+{
+    uint8x16_t shuffle = vld1q_u8(mask);
+    size_t     i       = 0;
+
+    for (; i + 16 <= bytes; i += 16)
+        vst1q_u8(dst + i, vqtbl1q_u8(vld1q_u8(src + i), shuffle));
+
+    return i;
+}
+#endif
+
+struct SwapKernel
+{
+    swap_kernel_t func = swap_none;
+    const char   *name = "scalar";
+
+    SwapKernel()
+    {
+#ifdef BSWAP_X86
+        if (cpu_has_avx2())
+        {
+            func = swap_avx2;
+            name = "avx2";
+        }
+        else if (cpu_has_ssse3())
+        {
+            func = swap_ssse3;
+            name = "ssse3";
+        }
+#elif defined(BSWAP_NEON)
+        func = swap_neon;
+        name = "neon";
+#endif
+    }
+};
+
+static const SwapKernel &kernel()
+{
+    static SwapKernel k;
+    return k;
+}
+
+void byte_swap_16(uint16_t *dst, const uint16_t *src, size_t count)
+{
+    size_t i = kernel().func((uint8_t *)dst, (const uint8_t *)src, count * 2, shuffle_mask[0]) / 2;
+    for (; i < count; i++)
+        dst[i] = byte_swap(src[i]);
+}
+
+void byte_swap_32(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    size_t i = kernel().func((uint8_t *)dst, (const uint8_t *)src, count * 4, shuffle_mask[1]) / 4;
+    for (; i < count; i++)
+        dst[i] = byte_swap(src[i]);
+}
+
+void byte_swap_64(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    size_t i = kernel().func((uint8_t *)dst, (const uint8_t *)src, count * 8, shuffle_mask[2]) / 8;
+    for (; i < count; i++)
+        dst[i] = byte_swap(src[i]);
+}
+
+const char *byte_swap_impl()
+{
+    return kernel().name;
+}
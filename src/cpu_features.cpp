@@ -0,0 +1,36 @@
+#include "cpu_features.h"
+
+#if defined(CPU_X86) && defined(_MSC_VER)
+    #include <intrin.h>
+    #include <immintrin.h>
+#endif
+
+bool cpu_has_ssse3()
+{
+#ifndef CPU_X86
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 9) & 1;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+bool cpu_has_avx2()
+{
+#ifndef CPU_X86
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    // the os has to save the ymm registers too
+    if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "log_sink.h"
+#include "logger.h"
+#include "myThread.h"
+
+// a queued line, short ones are kept in the slot
+struct LogRecord
+{
+    std::atomic<uint64_t> seq;
+    LOG_LEVEL             level;
+    LOG_COLOR_E           color;
+    uint32_t              prefix_len;
+    uint32_t              len;
+    char                 *heap;
+    char                  data[224]; // the slot is 256 bytes
+
+    const char *line() const { return heap ? heap : data; }
+};
+
+// bounded lock-free queue (Vyukov): a slot is free for position pos when its seq is pos, holds the line of pos when
+// it is pos + 1. producers and the writer both pop, the first for LOG_OVERFLOW_DROP_OLDEST
+struct LogQueue
+{
+    LogRecord            *slots = nullptr;
+    uint64_t              mask  = 0;
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+
+    int init(size_t size)
+    {
+        size_t count = 2;
+        while (count < size)
+            count <<= 1;
+
+        slots = new (std::nothrow) LogRecord[count];
+        if (!slots)
+            return -1;
+        for (size_t i = 0; i < count; i++)
+        {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+            slots[i].heap = nullptr;
+        }
+        mask = count - 1;
+        head.store(0);
+        tail.store(0);
+        return 0;
+    }
+
+    void release()
+    {
+        while (pop([](LogRecord &) {}))
+        {
+        }
+        delete[] slots;
+        slots = nullptr;
+    }
+
+    bool push(LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len)
+    {
+        uint64_t   pos = tail.load(std::memory_order_relaxed);
+        LogRecord *rec = nullptr;
+
+        while (true)
+        {
+            rec          = &slots[pos & mask];
+            int64_t diff = (int64_t)(rec->seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+
+        rec->level      = level;
+        rec->color      = color;
+        rec->prefix_len = (uint32_t)prefix_len;
+        rec->len        = (uint32_t)len;
+        rec->heap       = nullptr;
+        if (len > sizeof(rec->data))
+        {
+            rec->heap = (char *)malloc(len);
+            if (!rec->heap)
+                rec->len = 0;
+        }
+        if (rec->len > 0)
+            memcpy(rec->heap ? rec->heap : rec->data, line, len);
+        rec->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consume runs while the slot is still owned
+    template <typename F>
+    bool pop(F consume)
+    {
+        uint64_t   pos = head.load(std::memory_order_relaxed);
+        LogRecord *rec = nullptr;
+
+        while (true)
+        {
+            rec          = &slots[pos & mask];
+            int64_t diff = (int64_t)(rec->seq.load(std::memory_order_acquire) - (pos + 1));
+            if (diff == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+
+        consume(*rec);
+        free(rec->heap);
+        rec->heap = nullptr;
+        rec->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        return slots[pos & mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+};
+
+struct LogWriter : public MyThread
+{
+    LogQueue queue;
+
+    std::atomic<bool>       quit{false};
+    std::atomic<bool>       sleeping{false};
+    std::atomic<uint64_t>   pushed{0};
+    std::atomic<uint64_t>   done{0}; // written or dropped from the queue
+    std::mutex              mutex;
+    std::condition_variable cond;
+
+    ~LogWriter() { stop(); }
+
+    void wake()
+    {
+        if (sleeping.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_one();
+        }
+    }
+
+protected:
+    void stopping() override
+    {
+        quit = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_one();
+    }
+
+    void run() override
+    {
+        while (true)
+        {
+            if (drain() > 0)
+                continue;
+            if (quit)
+                break;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping = true;
+            if (queue.empty() && !quit)
+                cond.wait_for(lock, std::chrono::milliseconds(50));
+            sleeping = false;
+        }
+    }
+
+private:
+    static constexpr size_t batch_lines = 256;
+
+    // up to batch_lines lines, then one end_batch so the sinks write them together
+    size_t drain()
+    {
+        size_t count = 0;
+        while (count < batch_lines && queue.pop([](LogRecord &rec) {
+            Log::sinks_write(rec.level, rec.color, rec.line(), rec.prefix_len, rec.len, false);
+        }))
+            count++;
+
+        if (count > 0)
+        {
+            Log::sinks_end_batch();
+            done += count;
+        }
+        return count;
+    }
+};
+
+namespace Log
+{
+    struct AsyncState
+    {
+        std::atomic<bool>     active{false};
+        std::atomic<int>      users{0}; // log calls between checking active and finishing their push
+        std::atomic<uint64_t> dropped{0};
+        LOG_OVERFLOW_E        policy = LOG_OVERFLOW_BLOCK;
+        LogWriter            *writer = nullptr;
+        std::mutex            mutex; // start and stop
+
+        ~AsyncState() { stop_async(); }
+    };
+
+    static AsyncState async_state;
+
+    static void push_line(LogWriter *writer, LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len,
+                          size_t len)
+    {
+        int spins = 0;
+        while (!writer->queue.push(level, color, line, prefix_len, len))
+        {
+            if (async_state.policy == LOG_OVERFLOW_DROP_NEWEST)
+            {
+                async_state.dropped++;
+                return;
+            }
+            if (async_state.policy == LOG_OVERFLOW_DROP_OLDEST)
+            {
+                if (writer->queue.pop([](LogRecord &) {}))
+                {
+                    async_state.dropped++;
+                    writer->done++;
+                }
+                continue;
+            }
+
+            writer->wake();
+            if (++spins < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        writer->pushed++;
+        writer->wake();
+    }
+
+    void write_line(LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len)
+    {
+        if (prefix_len > len)
+            prefix_len = len;
+
+        if (async_state.active)
+        {
+            async_state.users++;
+            if (async_state.active)
+            {
+                push_line(async_state.writer, level, color, line, prefix_len, len);
+                async_state.users--;
+                return;
+            }
+            async_state.users--;
+        }
+        sinks_write(level, color, line, prefix_len, len, true);
+    }
+
+    int start_async(size_t queue_size, LOG_OVERFLOW_E policy)
+    {
+        std::lock_guard<std::mutex> lock(async_state.mutex);
+        if (async_state.writer)
+            return -1;
+
+        LogWriter *writer = new LogWriter;
+        if (writer->queue.init(queue_size) < 0)
+        {
+            delete writer;
+            return -1;
+        }
+
+        async_state.policy = policy;
+        async_state.writer = writer;
+        writer->start();
+        async_state.active = true;
+        return 0;
+    }
+
+    void stop_async()
+    {
+        std::lock_guard<std::mutex> lock(async_state.mutex);
+        if (!async_state.writer)
+            return;
+
+        // new lines are written directly, the ones on their way in are waited for, the writer drains the rest
+        async_state.active = false;
+        while (async_state.users > 0)
+            std::this_thread::yield();
+
+        async_state.writer->stop();
+        async_state.writer->queue.release();
+        delete async_state.writer;
+        async_state.writer = nullptr;
+        sinks_flush();
+    }
+
+    bool is_async()
+    {
+        return async_state.active;
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(async_state.mutex);
+        LogWriter                  *writer = async_state.writer;
+        if (!writer)
+        {
+            sinks_flush();
+            return;
+        }
+
+        uint64_t target = writer->pushed;
+        while (writer->done < target)
+        {
+            writer->wake();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        sinks_flush();
+    }
+
+    uint64_t get_dropped()
+    {
+        return async_state.dropped;
+    }
+} // namespace Log
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "binary_file.h"
+#include "log_binary.h"
+#include "logger.h"
+#include "timer.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct BinFormatEntry
+{
+    LOG_LEVEL   level;
+    LOG_COLOR_E color;
+    int         line;
+    std::string file;
+    std::string func;
+    std::string fmt;
+};
+
+struct BinLogState
+{
+    std::atomic<bool> active{false};
+    std::atomic<int>  users{0}; // bin_write calls between checking active and finishing their record
+    std::mutex        mutex;    // start and stop
+
+    // the call sites, kept across files. table_mutex also guards the mapping
+    std::vector<BinFormatEntry> formats;
+    std::mutex                  table_mutex;
+
+    uint8_t      *map_addr = nullptr;
+    uint64_t      map_size = 0;
+    BinLogHeader *header   = nullptr;
+    uint8_t      *ring     = nullptr;
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE map_handle = nullptr;
+#endif
+
+    ~BinLogState() { Log::stop_binary(); }
+};
+
+static BinLogState bin_state;
+
+static int map_log_file(const std::string &path, uint64_t size)
+{
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        Z_ERRF("open {} fail({})\n", path, GetLastError());
+        return -1;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    CloseHandle(file);
+    if (!mapping)
+    {
+        Z_ERRF("map {} fail({})\n", path, GetLastError());
+        return -1;
+    }
+    void *addr = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (!addr)
+    {
+        Z_ERRF("map {} fail({})\n", path, GetLastError());
+        CloseHandle(mapping);
+        return -1;
+    }
+    bin_state.map_handle = mapping;
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        Z_ERRF("open {} fail({})\n", path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) < 0)
+    {
+        Z_ERRF("resize {} fail({})\n", path, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    void *addr = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        Z_ERRF("map {} fail({})\n", path, strerror(errno));
+        return -1;
+    }
+#endif
+
+    bin_state.map_addr = (uint8_t *)addr;
+    bin_state.map_size = size;
+    return 0;
+}
+
+static void unmap_log_file()
+{
+    if (!bin_state.map_addr)
+        return;
+
+#if defined(WIN32) || defined(_WIN32)
+    FlushViewOfFile(bin_state.map_addr, 0);
+    UnmapViewOfFile(bin_state.map_addr);
+    CloseHandle(bin_state.map_handle);
+    bin_state.map_handle = nullptr;
+#else
+    munmap(bin_state.map_addr, (size_t)bin_state.map_size);
+#endif
+
+    bin_state.map_addr = nullptr;
+    bin_state.map_size = 0;
+    bin_state.header   = nullptr;
+    bin_state.ring     = nullptr;
+}
+
+// with table_mutex held. a full table drops the entry, the decoder shows its lines as unknown
+static void write_format(uint32_t id)
+{
+    BinLogHeader         *header = bin_state.header;
+    const BinFormatEntry &entry  = bin_state.formats[id];
+    if (!header)
+        return;
+
+    BinLogFormat format;
+    memset(&format, 0, sizeof(format));
+    format.id       = id;
+    format.line     = (uint32_t)entry.line;
+    format.color    = (uint32_t)entry.color;
+    format.file_len = (uint16_t)MIN(entry.file.size(), 0xffff);
+    format.func_len = (uint16_t)MIN(entry.func.size(), 0xffff);
+    format.fmt_len  = (uint16_t)MIN(entry.fmt.size(), 0xffff);
+    format.level    = (uint16_t)entry.level;
+    format.size     = ALIGN_UP(sizeof(format) + format.file_len + format.func_len + format.fmt_len, binlog_align);
+
+    uint64_t used = header->table_used.load(std::memory_order_relaxed);
+    if (used + format.size > header->table_size)
+        return;
+
+    uint8_t *dst = bin_state.map_addr + header->table_offset + used;
+    memset(dst, 0, format.size);
+    memcpy(dst, &format, sizeof(format));
+    dst += sizeof(format);
+    memcpy(dst, entry.file.data(), format.file_len);
+    dst += format.file_len;
+    memcpy(dst, entry.func.data(), format.func_len);
+    dst += format.func_len;
+    memcpy(dst, entry.fmt.data(), format.fmt_len);
+    header->table_used.store(used + format.size, std::memory_order_release);
+}
+
+// the arguments after a record header, cut where the record is full
+static uint32_t encode_args(uint8_t *buf, uint32_t size, const Log::FmtArg *args, size_t count)
+{
+    uint32_t pos = 0;
+
+    auto put_string = [&](const char *str, size_t len) {
+        if (pos + 5 > size)
+            return false;
+        uint32_t n = (uint32_t)MIN(len, (size_t)(size - pos - 5));
+        buf[pos++] = Log::FMT_ARG_STRING;
+        memcpy(buf + pos, &n, 4);
+        memcpy(buf + pos + 4, str, n);
+        pos += 4 + n;
+        return true;
+    };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Log::FmtArg &arg = args[i];
+        switch (arg.type)
+        {
+            case Log::FMT_ARG_INT:
+            case Log::FMT_ARG_UINT:
+                if (pos + 10 > size)
+                    return pos;
+                buf[pos]     = (uint8_t)arg.type;
+                buf[pos + 1] = arg.size;
+                memcpy(buf + pos + 2, &arg.u, 8);
+                pos += 10;
+                break;
+            case Log::FMT_ARG_DOUBLE:
+            case Log::FMT_ARG_POINTER:
+                if (pos + 9 > size)
+                    return pos;
+                buf[pos] = (uint8_t)arg.type;
+                if (arg.type == Log::FMT_ARG_DOUBLE)
+                    memcpy(buf + pos + 1, &arg.d, 8);
+                else
+                {
+                    uint64_t ptr = (uintptr_t)arg.p;
+                    memcpy(buf + pos + 1, &ptr, 8);
+                }
+                pos += 9;
+                break;
+            case Log::FMT_ARG_LONG_DOUBLE:
+                if (pos + 1 + sizeof(long double) > size)
+                    return pos;
+                buf[pos] = (uint8_t)arg.type;
+                memcpy(buf + pos + 1, &arg.ld, sizeof(long double));
+                pos += 1 + sizeof(long double);
+                break;
+            case Log::FMT_ARG_CSTR:
+            {
+                const char *str = arg.s ? arg.s : "(null)";
+                if (!put_string(str, strlen(str)))
+                    return pos;
+                break;
+            }
+            case Log::FMT_ARG_STRING:
+                if (!put_string(arg.str.data, arg.str.len))
+                    return pos;
+                break;
+            case Log::FMT_ARG_CUSTOM:
+            {
+                char           tmp[256];
+                Log::FmtBuffer out{tmp, sizeof(tmp) - 1};
+                arg.custom.put(out, arg.custom.obj);
+                if (!put_string(tmp, MIN(out.len, sizeof(tmp) - 1)))
+                    return pos;
+                break;
+            }
+            default:
+                return pos;
+        }
+    }
+    return pos;
+}
+
+// the body is a multiple of binlog_align bytes
+static uint32_t record_checksum(uint32_t id, uint64_t pos, const uint8_t *body, uint32_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull ^ id;
+    hash          = (hash ^ pos) * 0x100000001b3ull;
+    for (uint32_t i = 0; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, body + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// lapped: the ring went round since start was reserved, its bytes may belong to a newer record
+static bool record_lapped(const BinLogHeader *header, uint64_t start)
+{
+    return header->write_pos.load(std::memory_order_acquire) - start > header->ring_size;
+}
+
+static void put_record(uint32_t id, const Log::FmtArg *args, size_t count)
+{
+    BinLogHeader *header = bin_state.header;
+    uint8_t       rec[binlog_max_record];
+    uint32_t      len = sizeof(BinLogRecord);
+
+    len += encode_args(rec + len, binlog_max_record - len, args, count);
+    uint32_t size = ALIGN_UP(len, binlog_align);
+    memset(rec + len, 0, size - len);
+
+    // a record that doesn't fit in the rest of the block starts the next one
+    uint64_t pos   = header->write_pos.load(std::memory_order_relaxed);
+    uint64_t start = pos;
+    do
+    {
+        uint64_t room = header->block_size - pos % header->block_size;
+        start         = room < size ? pos + room : pos;
+    } while (!header->write_pos.compare_exchange_weak(pos, start + size, std::memory_order_relaxed));
+
+    BinLogRecord head;
+    if (start != pos && start - pos >= sizeof(BinLogRecord))
+    {
+        head.size     = (uint32_t)(start - pos);
+        head.id       = binlog_pad_id;
+        head.pos      = pos;
+        head.time_us  = 0;
+        head.checksum = 0;
+        head.reserved = 0;
+        memcpy(bin_state.ring + pos % header->ring_size, &head, sizeof(head));
+    }
+
+    // the header goes last, a half written record doesn't carry its position yet
+    uint8_t *dst = bin_state.ring + start % header->ring_size;
+    if (record_lapped(header, start))
+        return;
+    memcpy(dst + sizeof(head), rec + sizeof(head), size - sizeof(head));
+    head.size     = size;
+    head.id       = id;
+    head.pos      = start;
+    head.time_us  = gettime_us();
+    head.checksum = record_checksum(id, start, rec + sizeof(head), size - sizeof(head));
+    head.reserved = 0;
+    if (record_lapped(header, start))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(dst, &head, sizeof(head));
+}
+
+namespace Log
+{
+    int start_binary(const std::string &path, uint64_t ring_size)
+    {
+        std::lock_guard<std::mutex> lock(bin_state.mutex);
+        if (bin_state.active)
+            return -1;
+
+        ring_size        = MAX(ALIGN_UP(ring_size, binlog_block_size), 2 * (uint64_t)binlog_block_size);
+        uint64_t ring_at = ALIGN_UP(sizeof(BinLogHeader), binlog_block_size) + binlog_table_size;
+
+        std::lock_guard<std::mutex> table_lock(bin_state.table_mutex);
+        if (map_log_file(path, ring_at + ring_size) < 0)
+            return -1;
+
+        BinLogHeader *header = (BinLogHeader *)bin_state.map_addr;
+        memcpy(header->magic, BINLOG_MAGIC, sizeof(header->magic));
+        header->version      = BINLOG_VERSION;
+        header->block_size   = binlog_block_size;
+        header->table_offset = ALIGN_UP(sizeof(BinLogHeader), binlog_block_size);
+        header->table_size   = binlog_table_size;
+        header->ring_offset  = ring_at;
+        header->ring_size    = ring_size;
+        header->table_used.store(0);
+        header->write_pos.store(0);
+
+        bin_state.header = header;
+        bin_state.ring   = bin_state.map_addr + ring_at;
+        for (uint32_t id = 0; id < bin_state.formats.size(); id++)
+            write_format(id);
+
+        bin_state.active = true;
+        return 0;
+    }
+
+    void stop_binary()
+    {
+        std::lock_guard<std::mutex> lock(bin_state.mutex);
+        if (!bin_state.active)
+            return;
+
+        bin_state.active = false;
+        while (bin_state.users > 0)
+            std::this_thread::yield();
+
+        std::lock_guard<std::mutex> table_lock(bin_state.table_mutex);
+        unmap_log_file();
+    }
+
+    bool is_binary()
+    {
+        return bin_state.active.load(std::memory_order_relaxed);
+    }
+
+    uint32_t bin_register(LOG_LEVEL level, LOG_COLOR_E color, const char *file, int line, std::string_view func,
+                          const char *fmt)
+    {
+        std::lock_guard<std::mutex> lock(bin_state.table_mutex);
+
+        uint32_t id = (uint32_t)bin_state.formats.size();
+        bin_state.formats.push_back({level, color, line, file, std::string(func), fmt});
+        write_format(id);
+        return id;
+    }
+
+    void bin_write(uint32_t id, const FmtArg *args, size_t count)
+    {
+        bin_state.users++;
+        if (bin_state.active)
+            put_record(id, args, count);
+        bin_state.users--;
+    }
+
+    static bool decode_args(const uint8_t *buf, uint32_t size, std::vector<FmtArg> &args)
+    {
+        uint32_t pos = 0;
+
+        args.clear();
+        while (pos < size && buf[pos] != FMT_ARG_NONE)
+        {
+            FmtArg arg;
+            arg.type = (FMT_ARG_TYPE_E)buf[pos++];
+            switch (arg.type)
+            {
+                case FMT_ARG_INT:
+                case FMT_ARG_UINT:
+                    if (pos + 9 > size)
+                        return false;
+                    arg.size = buf[pos];
+                    memcpy(&arg.u, buf + pos + 1, 8);
+                    pos += 9;
+                    break;
+                case FMT_ARG_DOUBLE:
+                    if (pos + 8 > size)
+                        return false;
+                    memcpy(&arg.d, buf + pos, 8);
+                    pos += 8;
+                    break;
+                case FMT_ARG_POINTER:
+                {
+                    uint64_t ptr = 0;
+                    if (pos + 8 > size)
+                        return false;
+                    memcpy(&ptr, buf + pos, 8);
+                    arg.p = (const void *)(uintptr_t)ptr;
+                    pos += 8;
+                    break;
+                }
+                case FMT_ARG_LONG_DOUBLE:
+                    if (pos + sizeof(long double) > size)
+                        return false;
+                    memcpy(&arg.ld, buf + pos, sizeof(long double));
+                    pos += sizeof(long double);
+                    break;
+                case FMT_ARG_STRING:
+                {
+                    uint32_t len = 0;
+                    if (pos + 4 > size)
+                        return false;
+                    memcpy(&len, buf + pos, 4);
+                    if (len > size - pos - 4)
+                        return false;
+                    arg.str.data = (const char *)buf + pos + 4;
+                    arg.str.len  = len;
+                    pos += 4 + len;
+                    break;
+                }
+                default:
+                    return false;
+            }
+            args.push_back(arg);
+        }
+        return true;
+    }
+
+    int bin_decode(const std::string &path, FILE *out, bool show_time, LOG_LEVEL max_level)
+    {
+        BinaryReader reader;
+        std::string  file_path = path;
+        if (reader.open(file_path, true) < 0)
+            return -1;
+
+        // records are decoded in place from the mapping, a copy only where the file can't be mapped
+        const uint8_t *file     = nullptr;
+        uint64_t       file_len = reader.fileSize;
+        DataBlock      copy;
+        if (reader.mapped)
+            file = reader.peek_view(file_len).data;
+        else if (file_len > 0)
+        {
+            copy.create_aligned(file_len);
+            if (reader.read_at(0, copy.ptr(), file_len) != file_len)
+            {
+                Z_ERRF("read {} fail\n", path);
+                return -1;
+            }
+            file = copy.ptr();
+        }
+
+        const BinLogHeader *header = (const BinLogHeader *)file;
+        if (file_len < sizeof(BinLogHeader) || memcmp(header->magic, BINLOG_MAGIC, sizeof(header->magic)) != 0
+            || header->version != BINLOG_VERSION)
+        {
+            Z_ERRF("{} is not a binary log\n", path);
+            return -1;
+        }
+        uint64_t block_size = header->block_size;
+        uint64_t ring_size  = header->ring_size;
+        uint64_t table_used = header->table_used.load();
+        uint64_t write_pos  = header->write_pos.load();
+        if (block_size < sizeof(BinLogRecord) || ring_size % block_size != 0
+            || header->table_offset + MIN(table_used, header->table_size) > file_len
+            || header->ring_offset + ring_size > file_len)
+        {
+            Z_ERRF("{} has a broken header\n", path);
+            return -1;
+        }
+
+        std::vector<BinFormatEntry> formats;
+        const uint8_t              *table = file + header->table_offset;
+        for (uint64_t pos = 0; pos + sizeof(BinLogFormat) <= MIN(table_used, header->table_size);)
+        {
+            BinLogFormat format;
+            memcpy(&format, table + pos, sizeof(format));
+            if (format.size < sizeof(format) || pos + format.size > table_used
+                || sizeof(format) + format.file_len + format.func_len + format.fmt_len > format.size)
+                break;
+
+            const char *str = (const char *)table + pos + sizeof(format);
+            if (formats.size() <= format.id)
+                formats.resize(format.id + 1, {LOG_LEVEL_NONE, LOG_COLOR_NONE, -1, "", "", ""});
+            formats[format.id] = {(LOG_LEVEL)format.level,
+                                  (LOG_COLOR_E)format.color,
+                                  (int)format.line,
+                                  std::string(str, format.file_len),
+                                  std::string(str + format.file_len, format.func_len),
+                                  std::string(str + format.file_len + format.func_len, format.fmt_len)};
+            pos += format.size;
+        }
+
+        // the block write_pos is in, and the ones before it still in the ring
+        const uint8_t      *ring   = file + header->ring_offset;
+        uint64_t            blocks = ring_size / block_size;
+        uint64_t            last   = write_pos > 0 ? (write_pos - 1) / block_size : 0;
+        uint64_t            first  = last >= blocks ? last - blocks + 1 : 0;
+        std::vector<FmtArg> args;
+        for (uint64_t block = first; block <= last; block++)
+        {
+            uint64_t pos = block * block_size;
+            uint64_t end = MIN(pos + block_size, write_pos);
+            while (pos + sizeof(BinLogRecord) <= end)
+            {
+                BinLogRecord head;
+                memcpy(&head, ring + pos % ring_size, sizeof(head));
+                if (head.pos != pos || head.size < sizeof(head) || pos + head.size > end)
+                    break;
+
+                const uint8_t        *body  = ring + pos % ring_size + sizeof(head);
+                const BinFormatEntry *entry = nullptr;
+                if (head.id < formats.size() && formats[head.id].line >= 0)
+                    entry = &formats[head.id];
+
+                bool skip = head.id == binlog_pad_id
+                         || (entry && entry->level != LOG_LEVEL_NONE && entry->level > max_level);
+                if (!skip)
+                {
+                    if (show_time)
+                    {
+                        fprintf(out, "[%llu.%06llu] ", (ullong)(head.time_us / 1000000),
+                                (ullong)(head.time_us % 1000000));
+                    }
+
+                    if (head.checksum != record_checksum(head.id, pos, body, head.size - sizeof(head)))
+                        fprintf(out, "<overwritten record at %llu>\n", (ullong)pos);
+                    else if (!entry)
+                        fprintf(out, "<unknown format id %u>\n", head.id);
+                    else if (!decode_args(body, head.size - sizeof(head), args))
+                        fprintf(out, "<broken record at %llu>\n", (ullong)pos);
+                    else
+                    {
+                        std::string line = format(LOG_FMT("[{}:{} ({})]"), entry->file, entry->line, entry->func);
+                        line += vformat(entry->fmt.c_str(), args.data(), args.size());
+                        fwrite(line.data(), 1, line.size(), out);
+                    }
+                }
+                pos += head.size;
+            }
+        }
+        return 0;
+    }
+} // namespace Log
@@ -0,0 +1,527 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32)
+    #include <fcntl.h>
+    #include <io.h>
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "binary_file.h"
+#include "log_sink.h"
+#include "logger.h"
+#include "timer.h"
+
+#if !defined(WIN32) && !defined(_WIN32)
+static const char *const ansi_colors[LOG_COLOR_BUTT] = {
+    LOG_NONE,
+    LOG_BLUE,
+    LOG_GREEN,
+    LOG_RED,
+    LOG_CYAN,
+    LOG_PURPLE,
+    LOG_BROWN,
+    LOG_DARK_GRAY,
+    LOG_LIGHT_BLUE,
+    LOG_LIGHT_GREEN,
+    LOG_LIGHT_CYAN,
+    LOG_LIGHT_RED,
+    LOG_YELLOW,
+    LOG_LIGHT_PURPLE,
+    LOG_LIGHT_GRAY,
+    LOG_BLACK,
+    LOG_WHITE,
+};
+#else
+static const WORD console_colors[LOG_COLOR_BUTT] = {
+    0,
+    FOREGROUND_BLUE,
+    FOREGROUND_GREEN,
+    FOREGROUND_RED,
+    FOREGROUND_BLUE | FOREGROUND_GREEN,
+    FOREGROUND_BLUE | FOREGROUND_RED,
+    FOREGROUND_GREEN | FOREGROUND_RED,
+    FOREGROUND_INTENSITY,
+    FOREGROUND_BLUE | FOREGROUND_INTENSITY,
+    FOREGROUND_GREEN | FOREGROUND_INTENSITY,
+    FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY,
+    FOREGROUND_RED | FOREGROUND_INTENSITY,
+    FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY,
+    FOREGROUND_BLUE | FOREGROUND_RED | FOREGROUND_INTENSITY,
+    FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE,
+    0,
+    FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY,
+};
+#endif
+
+static bool is_terminal(FILE *fp)
+{
+#if defined(WIN32) || defined(_WIN32)
+    DWORD  mode   = 0;
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(fp));
+    return GetConsoleMode(handle, &mode) != 0;
+#else
+    return isatty(fileno(fp)) != 0;
+#endif
+}
+
+StreamSink::StreamSink(FILE *fp) : fp(fp)
+{
+    use_color = is_terminal(fp);
+    buffer    = new char[buffer_size];
+}
+
+StreamSink::~StreamSink()
+{
+    flush();
+    delete[] buffer;
+}
+
+void StreamSink::write_buffer()
+{
+    if (used > 0)
+        fwrite(buffer, 1, used, fp);
+    used = 0;
+}
+
+void StreamSink::write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len)
+{
+    (void)line_level;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!use_color || color <= LOG_COLOR_NONE || color >= LOG_COLOR_BUTT)
+        prefix_len = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+    // the console color is set between writes
+    if (prefix_len > 0)
+    {
+        write_buffer();
+
+        HANDLE                     hStdout = (HANDLE)_get_osfhandle(_fileno(fp));
+        CONSOLE_SCREEN_BUFFER_INFO csbiInfo;
+        GetConsoleScreenBufferInfo(hStdout, &csbiInfo);
+        auto wOldColorAttrs = csbiInfo.wAttributes;
+        fflush(fp);
+        SetConsoleTextAttribute(hStdout, console_colors[color]);
+        fwrite(line, 1, prefix_len, fp);
+        fflush(fp);
+        SetConsoleTextAttribute(hStdout, wOldColorAttrs);
+        line += prefix_len;
+        len -= prefix_len;
+        prefix_len = 0;
+    }
+    const char *color_start = "";
+    const char *color_end   = "";
+#else
+    const char *color_start = prefix_len > 0 ? ansi_colors[color] : "";
+    const char *color_end   = prefix_len > 0 ? LOG_NONE : "";
+#endif
+
+    size_t start_len = strlen(color_start);
+    size_t end_len   = strlen(color_end);
+    size_t total     = start_len + end_len + len;
+    if (used + total > buffer_size)
+        write_buffer();
+    if (total > buffer_size)
+    {
+        fwrite(color_start, 1, start_len, fp);
+        fwrite(line, 1, prefix_len, fp);
+        fwrite(color_end, 1, end_len, fp);
+        fwrite(line + prefix_len, 1, len - prefix_len, fp);
+        return;
+    }
+
+    memcpy(buffer + used, color_start, start_len);
+    used += start_len;
+    memcpy(buffer + used, line, prefix_len);
+    used += prefix_len;
+    memcpy(buffer + used, color_end, end_len);
+    used += end_len;
+    memcpy(buffer + used, line + prefix_len, len - prefix_len);
+    used += len - prefix_len;
+}
+
+void StreamSink::end_batch()
+{
+    flush();
+}
+
+void StreamSink::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write_buffer();
+    fflush(fp);
+}
+
+FileSink::FileSink(const std::string &path, bool append, size_t buffer_size)
+    : path(path), buffer_size(MAX(buffer_size, (size_t)4096))
+{
+    buffer = new char[this->buffer_size];
+    open_file(append);
+}
+
+FileSink::~FileSink()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    close_file();
+    delete[] buffer;
+}
+
+int FileSink::open_file(bool append)
+{
+    fp = fopen(path.c_str(), append ? "ab" : "wb");
+    if (!fp)
+    {
+        // not through Z_ERR, this sink may be the one it writes to
+        fprintf(stderr, "log file %s can't be opened(%s)\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    // the sink buffers whole batches itself
+    setvbuf(fp, NULL, _IONBF, 0);
+    fseek(fp, 0, SEEK_END);
+    file_size     = (uint64_t)ftell(fp);
+    last_write_ms = gettime_ms();
+    return 0;
+}
+
+void FileSink::close_file()
+{
+    write_buffer();
+    if (fp)
+        fclose(fp);
+    fp = nullptr;
+}
+
+void FileSink::write_buffer()
+{
+    if (fp && used > 0)
+    {
+        fwrite(buffer, 1, used, fp);
+        file_size += used;
+    }
+    used          = 0;
+    urgent        = false;
+    last_write_ms = gettime_ms();
+}
+
+void FileSink::write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len)
+{
+    (void)color;
+    (void)prefix_len;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    before_append(len);
+    if (!fp)
+        return;
+
+    if (used + len > buffer_size)
+        write_buffer();
+    if (len > buffer_size)
+    {
+        fwrite(line, 1, len, fp);
+        file_size += len;
+    }
+    else
+    {
+        memcpy(buffer + used, line, len);
+        used += len;
+    }
+    if (line_level != LOG_LEVEL_NONE && line_level <= flush_level)
+        urgent = true;
+}
+
+void FileSink::end_batch()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (used > 0 && (urgent || gettime_ms() - last_write_ms >= flush_interval_ms))
+        write_buffer();
+}
+
+void FileSink::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write_buffer();
+}
+
+RotatingFileSink::RotatingFileSink(const std::string &path, uint64_t max_size, int max_files, uint64_t interval_sec)
+    : FileSink(path, true), max_size(max_size), max_files(max_files), interval_ms(interval_sec * 1000)
+{
+    opened_ms = gettime_ms();
+}
+
+void RotatingFileSink::before_append(size_t len)
+{
+    uint64_t size = file_size + used;
+    if (size == 0)
+        return;
+    if ((max_size > 0 && size + len > max_size) || (interval_ms > 0 && gettime_ms() - opened_ms >= interval_ms))
+        rotate();
+}
+
+void RotatingFileSink::rotate()
+{
+    close_file();
+
+    if (max_files > 0)
+    {
+        // rename doesn't replace on windows, the oldest goes first
+        remove((path + "." + std::to_string(max_files)).c_str());
+        for (int i = max_files - 1; i >= 1; i--)
+            rename((path + "." + std::to_string(i)).c_str(), (path + "." + std::to_string(i + 1)).c_str());
+        rename(path.c_str(), (path + ".1").c_str());
+    }
+
+    open_file(false);
+    opened_ms = gettime_ms();
+}
+
+static std::atomic<MemorySink *> crash_sink{nullptr};
+static char                      crash_path[4096];
+
+static void write_fd(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        int n = _write(fd, data, (unsigned int)len);
+#else
+        ssize_t n = ::write(fd, data, len);
+#endif
+        if (n <= 0)
+            return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// only async signal safe calls from here
+static void memory_sink_crash(int sig)
+{
+    MemorySink *sink = crash_sink.load();
+    if (sink)
+    {
+#if defined(WIN32) || defined(_WIN32)
+        int fd = crash_path[0] ? _open(crash_path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644) : 2;
+#else
+        int fd = crash_path[0] ? ::open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 2;
+#endif
+        if (fd >= 0)
+        {
+            const char *first, *second;
+            size_t      first_len, second_len;
+            sink->segments(first, first_len, second, second_len);
+            write_fd(fd, first, first_len);
+            write_fd(fd, second, second_len);
+        }
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+MemorySink::MemorySink(size_t capacity) : capacity(MAX(capacity, (size_t)1))
+{
+    ring = new char[this->capacity];
+}
+
+MemorySink::~MemorySink()
+{
+    MemorySink *self = this;
+    crash_sink.compare_exchange_strong(self, nullptr);
+    delete[] ring;
+}
+
+void MemorySink::write(LOG_LEVEL line_level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len)
+{
+    (void)line_level;
+    (void)color;
+    (void)prefix_len;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (len > capacity)
+    {
+        line += len - capacity;
+        len = capacity;
+    }
+    size_t pos   = (size_t)(total % capacity);
+    size_t first = MIN(len, capacity - pos);
+    memcpy(ring + pos, line, first);
+    memcpy(ring, line + first, len - first);
+    total += len;
+}
+
+void MemorySink::segments(const char *&first, size_t &first_len, const char *&second, size_t &second_len) const
+{
+    if (total <= capacity)
+    {
+        first      = ring;
+        first_len  = (size_t)total;
+        second     = ring;
+        second_len = 0;
+        return;
+    }
+
+    size_t pos = (size_t)(total % capacity);
+    first      = ring + pos;
+    first_len  = capacity - pos;
+    second     = ring;
+    second_len = pos;
+
+    // the oldest line is cut, start at the next one
+    const char *eol = (const char *)memchr(first, '\n', first_len);
+    if (eol)
+    {
+        first_len -= eol + 1 - first;
+        first = eol + 1;
+        return;
+    }
+    eol = (const char *)memchr(second, '\n', second_len);
+    if (eol)
+    {
+        second_len -= eol + 1 - second;
+        second = eol + 1;
+    }
+    first_len = 0;
+}
+
+void MemorySink::dump(FILE *fp)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const char *first, *second;
+    size_t      first_len, second_len;
+    segments(first, first_len, second, second_len);
+    fwrite(first, 1, first_len, fp);
+    fwrite(second, 1, second_len, fp);
+    fflush(fp);
+}
+
+std::string MemorySink::contents()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const char *first, *second;
+    size_t      first_len, second_len;
+    segments(first, first_len, second, second_len);
+    return std::string(first, first_len) + std::string(second, second_len);
+}
+
+int MemorySink::install_crash_dump(const std::string &path)
+{
+    if (path.size() >= sizeof(crash_path))
+        return -1;
+
+    memcpy(crash_path, path.c_str(), path.size() + 1);
+    crash_sink = this;
+
+    const int signals[] = {
+        SIGSEGV, SIGFPE, SIGILL, SIGABRT,
+#ifdef SIGBUS
+        SIGBUS,
+#endif
+    };
+    for (int sig : signals)
+        signal(sig, memory_sink_crash);
+    return 0;
+}
+
+namespace Log
+{
+    using SinkVector = std::vector<std::shared_ptr<LogSink>>;
+
+    // never freed, lines may come from static destructors
+    struct SinkList
+    {
+        std::shared_ptr<const SinkVector> sinks;
+        std::mutex                        mutex; // add and remove
+    };
+
+    static SinkList &sink_list()
+    {
+        static SinkList *list = [] {
+            SinkList *res = new SinkList;
+            res->sinks    = std::make_shared<const SinkVector>(SinkVector{std::make_shared<StreamSink>(stderr)});
+            atexit(sinks_flush);
+            return res;
+        }();
+        return *list;
+    }
+
+    static std::shared_ptr<const SinkVector> current_sinks()
+    {
+        return std::atomic_load(&sink_list().sinks);
+    }
+
+    void add_sink(std::shared_ptr<LogSink> sink)
+    {
+        if (!sink)
+            return;
+
+        SinkList                   &list = sink_list();
+        std::lock_guard<std::mutex> lock(list.mutex);
+        SinkVector                  sinks(*list.sinks);
+        sinks.push_back(sink);
+        std::atomic_store(&list.sinks, std::make_shared<const SinkVector>(std::move(sinks)));
+    }
+
+    void remove_sink(const std::shared_ptr<LogSink> &sink)
+    {
+        SinkList                   &list = sink_list();
+        std::lock_guard<std::mutex> lock(list.mutex);
+        SinkVector                  sinks(*list.sinks);
+        sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+        std::atomic_store(&list.sinks, std::make_shared<const SinkVector>(std::move(sinks)));
+        sink->flush();
+    }
+
+    void clear_sinks()
+    {
+        SinkList                         &list = sink_list();
+        std::lock_guard<std::mutex>       lock(list.mutex);
+        std::shared_ptr<const SinkVector> old = list.sinks;
+        std::atomic_store(&list.sinks, std::make_shared<const SinkVector>());
+        for (auto &sink : *old)
+            sink->flush();
+    }
+
+    void sinks_write(LOG_LEVEL level, LOG_COLOR_E color, const char *line, size_t prefix_len, size_t len,
+                     bool end_batch)
+    {
+        std::shared_ptr<const SinkVector> sinks = current_sinks();
+        for (auto &sink : *sinks)
+        {
+            if (sink->level != LOG_LEVEL_NONE && level <= sink->level)
+            {
+                sink->write(level, color, line, prefix_len, len);
+                if (end_batch)
+                    sink->end_batch();
+            }
+        }
+    }
+
+    void sinks_end_batch()
+    {
+        std::shared_ptr<const SinkVector> sinks = current_sinks();
+        for (auto &sink : *sinks)
+            sink->end_batch();
+    }
+
+    void sinks_flush()
+    {
+        std::shared_ptr<const SinkVector> sinks = current_sinks();
+        for (auto &sink : *sinks)
+            sink->flush();
+    }
+} // namespace Log
@@ -1,5 +1,6 @@
 
 
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -60,6 +61,313 @@ namespace Log
     {
         return log_level;
     }
+
+    struct FmtSpec
+    {
+        bool left      = false;
+        bool plus      = false;
+        bool space     = false;
+        bool alt       = false;
+        bool zero      = false;
+        int  width     = 0;
+        int  precision = -1;
+        char conv      = 0;
+    };
+
+    // [flags][width][.precision][length]conversion, the length is dropped, the argument type decides it
+    static bool parse_spec(const char *spec, size_t len, FmtSpec &res)
+    {
+        const char *end = spec + len;
+        const char *c   = spec;
+
+        for (; c < end && fmt_has("-+ #0", *c); c++)
+        {
+            res.left  |= *c == '-';
+            res.plus  |= *c == '+';
+            res.space |= *c == ' ';
+            res.alt   |= *c == '#';
+            res.zero  |= *c == '0';
+        }
+        for (; c < end && *c >= '0' && *c <= '9'; c++)
+            res.width = res.width * 10 + (*c - '0');
+        if (c < end && *c == '.')
+        {
+            res.precision = 0;
+            for (c++; c < end && *c >= '0' && *c <= '9'; c++)
+                res.precision = res.precision * 10 + (*c - '0');
+        }
+        while (c < end && fmt_has("hlLqjzt", *c))
+            c++;
+        if (c + 1 != end || !fmt_has("diouxXeEfFgGaAcsp", *c))
+            return false;
+        res.conv = *c;
+        return true;
+    }
+
+    static void put_padded(FmtBuffer &out, const FmtSpec &spec, const char *str, size_t len)
+    {
+        size_t pad = spec.width > 0 && (size_t)spec.width > len ? spec.width - len : 0;
+        if (!spec.left)
+            out.append_fill(' ', pad);
+        out.append(str, len);
+        if (spec.left)
+            out.append_fill(' ', pad);
+    }
+
+    static void put_integer(FmtBuffer &out, const FmtArg &arg, const FmtSpec &spec)
+    {
+        unsigned long long mag  = arg.u;
+        bool               neg  = false;
+        int                base = spec.conv == 'o' ? 8 : (spec.conv == 'x' || spec.conv == 'X') ? 16 : 10;
+        char               digits[72];
+        char               prefix[2];
+        int                prefix_len = 0;
+
+        if (spec.conv == 'd' || spec.conv == 'i')
+        {
+            // as printf, unsigned int and unsigned 64 bit values are read back as signed
+            long long val = arg.type == FMT_ARG_INT ? arg.i : (long long)arg.u;
+            if (arg.type == FMT_ARG_UINT && arg.size == sizeof(int))
+                val = (int)(unsigned int)arg.u;
+            neg = val < 0;
+            mag = neg ? 0ull - (unsigned long long)val : (unsigned long long)val;
+        }
+        else if (arg.type == FMT_ARG_INT && arg.size < sizeof(mag))
+        {
+            mag &= (1ull << (arg.size * 8)) - 1;
+        }
+
+        if (spec.conv == 'c')
+        {
+            char c = (char)mag;
+            put_padded(out, spec, &c, 1);
+            return;
+        }
+
+        size_t ndigits = 0;
+        if (mag != 0 || spec.precision != 0)
+            ndigits = std::to_chars(digits, digits + sizeof(digits), mag, base).ptr - digits;
+        if (spec.conv == 'X')
+        {
+            for (size_t i = 0; i < ndigits; i++)
+                digits[i] = (char)toupper(digits[i]);
+        }
+
+        if (neg)
+            prefix[prefix_len++] = '-';
+        else if ((spec.conv == 'd' || spec.conv == 'i') && spec.plus)
+            prefix[prefix_len++] = '+';
+        else if ((spec.conv == 'd' || spec.conv == 'i') && spec.space)
+            prefix[prefix_len++] = ' ';
+        else if (spec.alt && mag != 0 && (spec.conv == 'x' || spec.conv == 'X'))
+        {
+            prefix[prefix_len++] = '0';
+            prefix[prefix_len++] = spec.conv;
+        }
+
+        size_t zeros = spec.precision > 0 && (size_t)spec.precision > ndigits ? spec.precision - ndigits : 0;
+        if (spec.alt && spec.conv == 'o' && zeros == 0 && (ndigits == 0 || digits[0] != '0'))
+            zeros = 1;
+
+        size_t total = prefix_len + zeros + ndigits;
+        size_t pad   = spec.width > 0 && (size_t)spec.width > total ? spec.width - total : 0;
+        if (!spec.left && !(spec.zero && spec.precision < 0))
+            out.append_fill(' ', pad);
+        out.append(prefix, prefix_len);
+        if (!spec.left && spec.zero && spec.precision < 0)
+            out.append_fill('0', pad);
+        out.append_fill('0', zeros);
+        out.append(digits, ndigits);
+        if (spec.left)
+            out.append_fill(' ', pad);
+    }
+
+    static void put_printf(FmtBuffer &out, const FmtArg &arg, const char *spec, size_t spec_len)
+    {
+        char fmt[(int)fmt_spec_max + 4];
+        int  pos = 0;
+
+        fmt[pos++] = '%';
+        for (size_t i = 0; i + 1 < spec_len && pos < (int)fmt_spec_max; i++)
+        {
+            if (!fmt_has("hlLqjzt", spec[i]))
+                fmt[pos++] = spec[i];
+        }
+        if (arg.type == FMT_ARG_LONG_DOUBLE)
+            fmt[pos++] = 'L';
+        fmt[pos++] = spec[spec_len - 1];
+        fmt[pos]   = '\0';
+
+        if (arg.type == FMT_ARG_LONG_DOUBLE)
+            out.append_printf(fmt, arg.ld);
+        else if (arg.type == FMT_ARG_DOUBLE)
+            out.append_printf(fmt, arg.d);
+        else
+            out.append_printf(fmt, arg.p);
+    }
+
+    static void put_default(FmtBuffer &out, const FmtArg &arg)
+    {
+        char tmp[64];
+
+        switch (arg.type)
+        {
+            case FMT_ARG_INT:
+                out.append_int(arg.i);
+                break;
+            case FMT_ARG_UINT:
+                out.append_int(arg.u);
+                break;
+            case FMT_ARG_DOUBLE:
+                // %g, as operator<< prints it
+                out.append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), arg.d, std::chars_format::general, 6).ptr - tmp);
+                break;
+            case FMT_ARG_LONG_DOUBLE:
+                out.append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), arg.ld, std::chars_format::general, 6).ptr - tmp);
+                break;
+            case FMT_ARG_CSTR:
+            {
+                const char *str = arg.s ? arg.s : "(null)";
+                out.append(str, strlen(str));
+                break;
+            }
+            case FMT_ARG_STRING:
+                out.append(arg.str.data, arg.str.len);
+                break;
+            case FMT_ARG_POINTER:
+                if (!arg.p)
+                {
+                    out.append("0", 1);
+                    break;
+                }
+                out.append("0x", 2);
+                out.append_int((uintptr_t)arg.p, 16);
+                break;
+            case FMT_ARG_CUSTOM:
+                arg.custom.put(out, arg.custom.obj);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void fmt_arg_put(FmtBuffer &out, const FmtArg &arg, const char *spec, size_t spec_len)
+    {
+        FmtSpec parsed;
+        if (spec_len == 0 || spec_len > fmt_spec_max || !parse_spec(spec, spec_len, parsed))
+        {
+            put_default(out, arg);
+            return;
+        }
+
+        switch (arg.type)
+        {
+            case FMT_ARG_INT:
+            case FMT_ARG_UINT:
+                if (fmt_has("diouxXc", parsed.conv))
+                    return put_integer(out, arg, parsed);
+                break;
+            case FMT_ARG_DOUBLE:
+            case FMT_ARG_LONG_DOUBLE:
+                if (fmt_has("eEfFgGaA", parsed.conv))
+                    return put_printf(out, arg, spec, spec_len);
+                break;
+            case FMT_ARG_CSTR:
+            case FMT_ARG_STRING:
+                if (parsed.conv == 's')
+                {
+                    const char *str = arg.type == FMT_ARG_STRING ? arg.str.data : arg.s ? arg.s : "(null)";
+                    size_t      len = arg.type == FMT_ARG_STRING ? arg.str.len : strlen(str);
+                    if (parsed.precision >= 0 && (size_t)parsed.precision < len)
+                        len = parsed.precision;
+                    return put_padded(out, parsed, str, len);
+                }
+                break;
+            case FMT_ARG_POINTER:
+                if (parsed.conv == 'p')
+                    return put_printf(out, arg, spec, spec_len);
+                break;
+            default:
+                break;
+        }
+        put_default(out, arg);
+    }
+
+    size_t vformat_to(char *buf, size_t size, const char *fmt, const FmtArg *args, size_t count)
+    {
+        FmtBuffer   out{buf, size ? size - 1 : 0};
+        const char *pre_pos = fmt;
+        const char *c       = fmt;
+        size_t      arg_idx = 0;
+
+        while (*c != '\0')
+        {
+            if ('\\' == *c)
+            {
+                if ('{' == *(c + 1))
+                {
+                    out.append(pre_pos, c - pre_pos);
+                    c++;
+                    pre_pos = c;
+                }
+                c++;
+            }
+            else if ('{' == *c)
+            {
+                const char *r_pos = strchr(c, '}');
+                if (!r_pos)
+                    break;
+
+                out.append(pre_pos, c - pre_pos);
+                if (arg_idx < count)
+                    fmt_arg_put(out, args[arg_idx], c + 1, r_pos - c - 1);
+                arg_idx++;
+
+                c       = r_pos + 1;
+                pre_pos = c;
+            }
+            else
+            {
+                c++;
+            }
+        }
+        out.append(pre_pos, strlen(pre_pos));
+
+        if (size > 0)
+            buf[out.len < size ? out.len : size - 1] = '\0';
+        return out.len;
+    }
+
+    std::string vformat(const char *fmt, const FmtArg *args, size_t count)
+    {
+        char   buf[fmt_stack_size];
+        size_t len = vformat_to(buf, sizeof(buf), fmt, args, count);
+        if (len < sizeof(buf))
+            return string(buf, len);
+
+        string str(len, '\0');
+        vformat_to(&str[0], len + 1, fmt, args, count);
+        return str;
+    }
+
+    size_t format_prefix(char *buf, size_t size, const char *file, int line, std::string_view func)
+    {
+        return format_to(buf, size, LOG_FMT("[{}:{} ({})]"), file, line, func);
+    }
+
+    void voutput(FILE *fp, const char *fmt, const FmtArg *args, size_t count)
+    {
+        char   buf[fmt_stack_size];
+        size_t len = vformat_to(buf, sizeof(buf), fmt, args, count);
+        if (len < sizeof(buf))
+        {
+            fwrite(buf, 1, len, fp);
+            return;
+        }
+
+        string str = vformat(fmt, args, count);
+        fwrite(str.data(), 1, str.size(), fp);
+    }
 } // namespace Log
 
 std::string getBaseName(std::string &path)
@@ -93,7 +401,7 @@ void str_insert(char *str, uint64_t max_size, char c, int pos)
     uint64_t str_size = strlen(str);
     if (str_size + 2 > max_size)
     {
-        Z_ERR("size too small %d, %d\n", str_size, max_size);
+        Z_ERRF("size too small {}, {}\n", str_size, max_size);
         return;
     }
     char *dst = NULL;
@@ -101,7 +409,7 @@ void str_insert(char *str, uint64_t max_size, char c, int pos)
     dst = (char *)calloc(str_size + 2, 1);
     if (!dst)
     {
-        Z_ERR("alloc fail\n");
+        Z_ERRF("alloc fail\n");
         return;
     }
 
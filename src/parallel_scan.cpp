@@ -0,0 +1,38 @@
+#include "parallel_scan.h"
+
+static const uint64_t ts_packet_size = 188;
+static const uint8_t  ts_sync_byte   = 0x47;
+
+static bool is_ts_sync(BinaryReader &reader, uint64_t pos)
+{
+    if (pos >= reader.fileSize)
+        return true;
+
+    reader.set_cursor(pos);
+    return reader.read_u8() == ts_sync_byte;
+}
+
+uint64_t resync_ts_packet(BinaryReader &reader, uint64_t pos)
+{
+    while (pos < reader.fileSize)
+    {
+        reader.set_cursor(pos);
+        ByteView view = reader.peek_window();
+        if (view.empty())
+            break;
+
+        const uint8_t *found = (const uint8_t *)memchr(view.data, ts_sync_byte, (size_t)view.size);
+        if (!found)
+        {
+            pos += view.size;
+            continue;
+        }
+
+        pos += found - view.data;
+        if (is_ts_sync(reader, pos + ts_packet_size) && is_ts_sync(reader, pos + ts_packet_size * 2))
+            return pos;
+        pos++;
+    }
+
+    return reader.fileSize;
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "log_binary.h"
+
+// binlog_decode [-t] [-l err|warn|info|dbg] file: the lines of a binary log, oldest first. -t puts the time of each
+// line in front, -l skips the Z_* lines above a level
+int main(int argc, char **argv)
+{
+    static const char *const levels[] = {"none", "err", "warn", "info", "dbg"};
+
+    bool        show_time = false;
+    LOG_LEVEL   max_level = LOG_LEVEL_ALL;
+    std::string path;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+            show_time = true;
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+        {
+            i++;
+            int level = LOG_LEVEL_BUTT;
+            for (int l = LOG_LEVEL_ERR; l < LOG_LEVEL_BUTT; l++)
+            {
+                if (strcmp(argv[i], levels[l]) == 0)
+                    level = l;
+            }
+            if (level == LOG_LEVEL_BUTT)
+            {
+                fprintf(stderr, "unknown level %s\n", argv[i]);
+                return 1;
+            }
+            max_level = (LOG_LEVEL)level;
+        }
+        else
+            path = argv[i];
+    }
+    if (path.empty())
+    {
+        fprintf(stderr, "usage: %s [-t] [-l err|warn|info|dbg] file\n", argv[0]);
+        return 1;
+    }
+
+    return Log::bin_decode(path, stdout, show_time, max_level) < 0 ? 1 : 0;
+}